@@ -0,0 +1,388 @@
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+#include "mapreduce.h"
+#include <math.h>
+#include <stdint.h>
+
+// Streaming aggregates over keys whose values are counts written with
+// MR_EmitU64. Each one is a combiner/reducer pair that finds its state through
+// MR_JobState, so set MR_Options.job_state to the aggregate before starting
+// the job, and read the answer once MR_Wait returns. None of them writes
+// result files, and their state has a fixed size whatever the vocabulary:
+//   top-K       - MR_SumCombiner, MR_TopKReducer: exact counts, a bounded
+//                 heap of the K largest per partition, merged by MR_TopKResult
+//   Count-Min   - MR_CountMinCombiner, MR_CountMinReducer: counts folded into
+//                 a sketch of width x depth counters by the combiner itself,
+//                 so no key reaches the shuffle
+//   HyperLogLog - MR_HyperLogLogCombiner, MR_HyperLogLogReducer: distinct
+//                 keys in 2^precision registers, also folded in by the combiner
+// The state lives in the calling process, so use these with MR_Run* and
+// MR_Submit*, not MR_RunProcesses. The Count-Min and HyperLogLog combiners
+// emit nothing, so their jobs must not set MR_Options.cache_dir.
+
+typedef struct MR_TopKEntry {
+    char *key;                          // Copy of the key, NUL terminated
+    size_t length;                      // Bytes in the key
+    uint64_t count;
+} MR_TopKEntry;
+
+typedef struct MR_TopK {
+    unsigned int k;
+    unsigned int numParts;
+    MR_TopKEntry **heaps;               // Min-heap per partition, the weakest entry on top
+    unsigned int *sizes;
+    MR_TopKEntry *result;               // Global top K, strongest first, built by MR_TopKResult
+    unsigned int resultCount;
+} MR_TopK;
+
+typedef struct MR_CountMin {
+    unsigned int width;                 // Counters per row
+    unsigned int depth;                 // Rows, each with its own hash
+    uint64_t *counters;                 // depth rows of width counters, updated atomically
+    uint64_t total;                     // Sum of every count added
+} MR_CountMin;
+
+typedef struct MR_HyperLogLog {
+    unsigned int precision;             // Bits of the hash picking a register
+    unsigned char *registers;           // 2^precision registers, updated with an atomic max
+} MR_HyperLogLog;
+
+/**
+* Sum the key's counts
+* Parameters:
+*     key           - Key being combined or reduced
+*     partition_idx - Partition of the key
+* Return:
+*     uint64_t      - Sum of the values, read with MR_GetNextU64
+*/
+uint64_t MR_SumCounts(char *key, unsigned int partition_idx){
+    uint64_t count = 0, value;
+    while(MR_GetNextU64(key, partition_idx, &value)){
+        count += value;
+    }
+    return count;
+}
+
+/**
+* Combiner adding up a key's MR_EmitU64 counts, so each map task ships one
+* count per key. Pairs with MR_TopKReducer, or any reducer summing counts
+*/
+void MR_SumCombiner(char *key, unsigned int partition_idx){
+    MR_EmitU64(key, MR_KeyLength(key), MR_SumCounts(key, partition_idx));
+}
+
+/**
+* Create a top-K aggregate, to be set as MR_Options.job_state
+* Parameters:
+*     k             - Number of keys to keep
+*     num_parts     - MR_Options.num_parts of the job
+* Return:
+*     MR_TopK*      - Empty aggregate, freed with MR_TopKDestroy
+*/
+MR_TopK *MR_TopKCreate(unsigned int k, unsigned int num_parts){
+    MR_TopK *top = (MR_TopK *)malloc(sizeof(MR_TopK));
+    top->k = k;
+    top->numParts = num_parts;
+    top->heaps = (MR_TopKEntry **)malloc(sizeof(MR_TopKEntry *) * num_parts);
+    for(unsigned int p = 0; p < num_parts; p++){
+        top->heaps[p] = (MR_TopKEntry *)malloc(sizeof(MR_TopKEntry) * (k > 0 ? k : 1));
+        if(top->heaps[p] == NULL){
+            perror("MR_TopKCreate");
+            exit(EXIT_FAILURE);
+        }
+    }
+    top->sizes = (unsigned int *)calloc(num_parts, sizeof(unsigned int));
+    top->result = NULL;
+    top->resultCount = 0;
+    return top;
+}
+
+void MR_TopKDestroy(MR_TopK *top){
+    for(unsigned int p = 0; p < top->numParts; p++){
+        for(unsigned int i = 0; i < top->sizes[p]; i++){
+            free(top->heaps[p][i].key);
+        }
+        free(top->heaps[p]);
+    }
+    for(unsigned int i = 0; i < top->resultCount; i++){
+        free(top->result[i].key);
+    }
+    free(top->heaps);
+    free(top->sizes);
+    free(top->result);
+    free(top);
+}
+
+/**
+* Order top-K entries by count, ties going to the smaller key so results do
+* not depend on which partition a key landed in
+* Return:
+*     bool          - true if a ranks below b
+*/
+bool topKWeaker(const MR_TopKEntry *a, const MR_TopKEntry *b){
+    if(a->count != b->count){
+        return a->count < b->count;
+    }
+    size_t length = (a->length < b->length) ? a->length : b->length;
+    int order = memcmp(a->key, b->key, length);
+    return (order != 0) ? order > 0 : a->length > b->length;
+}
+
+void topKSiftDown(MR_TopKEntry *heap, unsigned int size, unsigned int i){
+    while(1){
+        unsigned int weakest = i, left = 2 * i + 1, right = 2 * i + 2;
+        if(left < size && topKWeaker(&heap[left], &heap[weakest])){
+            weakest = left;
+        }
+        if(right < size && topKWeaker(&heap[right], &heap[weakest])){
+            weakest = right;
+        }
+        if(weakest == i){
+            return;
+        }
+        MR_TopKEntry swap = heap[i];
+        heap[i] = heap[weakest];
+        heap[weakest] = swap;
+        i = weakest;
+    }
+}
+
+/**
+* Offer an entry to a bounded min-heap of the k strongest entries. The key
+* is only copied if the entry gets in
+* Parameters:
+*     heap          - Heap with room for k entries
+*     size          - Entries in the heap, updated
+*     k             - Capacity
+*     entry         - Candidate, its key is not kept
+*/
+void topKOffer(MR_TopKEntry *heap, unsigned int *size, unsigned int k, const MR_TopKEntry *entry){
+    if(*size == k && (k == 0 || !topKWeaker(&heap[0], entry))){
+        return;
+    }
+    MR_TopKEntry copy = *entry;
+    copy.key = (char *)malloc(entry->length + 1);
+    memcpy(copy.key, entry->key, entry->length);
+    copy.key[entry->length] = '\0';
+    if(*size < k){
+        unsigned int i = (*size)++;
+        while(i > 0 && topKWeaker(&copy, &heap[(i - 1) / 2])){
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = copy;
+    }
+    else{
+        free(heap[0].key);
+        heap[0] = copy;
+        topKSiftDown(heap, *size, 0);
+    }
+}
+
+/**
+* Reducer keeping the K keys with the largest summed counts of each
+* partition. A partition is reduced by one task at a time, so its heap takes
+* no lock
+*/
+void MR_TopKReducer(char *key, unsigned int partition_idx){
+    MR_TopK *top = (MR_TopK *)MR_JobState();
+    MR_TopKEntry entry = {key, MR_KeyLength(key), MR_SumCounts(key, partition_idx)};
+    assert(top != NULL && partition_idx < top->numParts);
+    topKOffer(top->heaps[partition_idx], &top->sizes[partition_idx], top->k, &entry);
+}
+
+int compareTopKEntries(const void *a, const void *b){
+    const MR_TopKEntry *x = (const MR_TopKEntry *)a, *y = (const MR_TopKEntry *)b;
+    return topKWeaker(y, x) ? -1 : (topKWeaker(x, y) ? 1 : 0);
+}
+
+/**
+* Merge the partitions' heaps into the global top K, once the job is done
+* Parameters:
+*     top           - Aggregate of a finished job
+*     count         - Set to the number of entries, at most k
+* Return:
+*     MR_TopKEntry* - Entries by descending count, owned by top
+*/
+const MR_TopKEntry *MR_TopKResult(MR_TopK *top, unsigned int *count){
+    for(unsigned int i = 0; i < top->resultCount; i++){
+        free(top->result[i].key);
+    }
+    free(top->result);
+    top->result = (MR_TopKEntry *)malloc(sizeof(MR_TopKEntry) * (top->k > 0 ? top->k : 1));
+    top->resultCount = 0;
+    for(unsigned int p = 0; p < top->numParts; p++){
+        for(unsigned int i = 0; i < top->sizes[p]; i++){
+            topKOffer(top->result, &top->resultCount, top->k, &top->heaps[p][i]);
+        }
+    }
+    qsort(top->result, top->resultCount, sizeof(MR_TopKEntry), compareTopKEntries);
+    *count = top->resultCount;
+    return top->result;
+}
+
+/**
+* Create a Count-Min sketch, to be set as MR_Options.job_state. An estimate
+* is never below the true count, and exceeds it by more than e / width of
+* the total with probability at most e^-depth
+* Parameters:
+*     width         - Counters per row
+*     depth         - Rows
+* Return:
+*     MR_CountMin*  - Empty sketch, freed with MR_CountMinDestroy
+*/
+MR_CountMin *MR_CountMinCreate(unsigned int width, unsigned int depth){
+    MR_CountMin *sketch = (MR_CountMin *)malloc(sizeof(MR_CountMin));
+    sketch->width = (width > 0) ? width : 1;
+    sketch->depth = (depth > 0) ? depth : 1;
+    sketch->counters = (uint64_t *)calloc((size_t)sketch->width * sketch->depth, sizeof(uint64_t));
+    sketch->total = 0;
+    return sketch;
+}
+
+void MR_CountMinDestroy(MR_CountMin *sketch){
+    free(sketch->counters);
+    free(sketch);
+}
+
+/**
+* Counter of a key in one row. The rows' hashes are derived from two
+* (Kirsch-Mitzenmacher), so the key is hashed once
+*/
+size_t countMinIndex(const MR_CountMin *sketch, uint64_t hash, uint64_t step, unsigned int row){
+    return (size_t)row * sketch->width + (size_t)((hash + row * step) % sketch->width);
+}
+
+/**
+* Add to a key's count. Safe to call from several threads at once
+* Parameters:
+*     sketch        - Sketch to update
+*     key           - Key bytes
+*     length        - Bytes in the key
+*     count         - Amount to add
+*/
+void MR_CountMinAdd(MR_CountMin *sketch, const char *key, size_t length, uint64_t count){
+    uint64_t hash = MR_HashBytes(key, length), step = hashMix(hash, HASH_SECRET1) | 1;
+    for(unsigned int row = 0; row < sketch->depth; row++){
+        __atomic_add_fetch(&sketch->counters[countMinIndex(sketch, hash, step, row)], count, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&sketch->total, count, __ATOMIC_RELAXED);
+}
+
+/**
+* Estimate a key's count, once the job is done
+* Parameters:
+*     sketch        - Sketch of a finished job
+*     key           - Key bytes
+*     length        - Bytes in the key
+* Return:
+*     uint64_t      - Smallest of the key's counters
+*/
+uint64_t MR_CountMinEstimate(const MR_CountMin *sketch, const char *key, size_t length){
+    uint64_t hash = MR_HashBytes(key, length), step = hashMix(hash, HASH_SECRET1) | 1;
+    uint64_t estimate = UINT64_MAX;
+    for(unsigned int row = 0; row < sketch->depth; row++){
+        uint64_t counter = sketch->counters[countMinIndex(sketch, hash, step, row)];
+        estimate = (counter < estimate) ? counter : estimate;
+    }
+    return estimate;
+}
+
+/**
+* Combiner adding the map task's count of a key to the sketch. It emits
+* nothing, so the key never reaches the partitions
+*/
+void MR_CountMinCombiner(char *key, unsigned int partition_idx){
+    MR_CountMin *sketch = (MR_CountMin *)MR_JobState();
+    assert(sketch != NULL);
+    MR_CountMinAdd(sketch, key, MR_KeyLength(key), MR_SumCounts(key, partition_idx));
+}
+
+/**
+* Reducer for keys that reach the partitions, when the job runs without
+* MR_CountMinCombiner
+*/
+void MR_CountMinReducer(char *key, unsigned int partition_idx){
+    MR_CountMinCombiner(key, partition_idx);
+}
+
+/**
+* Create a HyperLogLog counter of distinct keys, to be set as
+* MR_Options.job_state. The standard error is about 1.04 / sqrt(2^precision)
+* Parameters:
+*     precision     - Register index bits, 4 to 18; 14 gives 16 KB and 0.8%
+* Return:
+*     MR_HyperLogLog* - Empty counter, freed with MR_HyperLogLogDestroy
+*/
+MR_HyperLogLog *MR_HyperLogLogCreate(unsigned int precision){
+    MR_HyperLogLog *counter = (MR_HyperLogLog *)malloc(sizeof(MR_HyperLogLog));
+    counter->precision = (precision < 4) ? 4 : (precision > 18 ? 18 : precision);
+    counter->registers = (unsigned char *)calloc((size_t)1 << counter->precision, 1);
+    return counter;
+}
+
+void MR_HyperLogLogDestroy(MR_HyperLogLog *counter){
+    free(counter->registers);
+    free(counter);
+}
+
+/**
+* Add a key. Safe to call from several threads at once
+* Parameters:
+*     counter       - Counter to update
+*     key           - Key bytes
+*     length        - Bytes in the key
+*/
+void MR_HyperLogLogAdd(MR_HyperLogLog *counter, const char *key, size_t length){
+    uint64_t hash = MR_HashBytes(key, length);
+    unsigned char *reg = &counter->registers[hash >> (64 - counter->precision)];
+    uint64_t rest = (hash << counter->precision) | ((uint64_t)1 << (counter->precision - 1)); // never all zero
+    unsigned char rank = (unsigned char)(__builtin_clzll(rest) + 1);
+    unsigned char seen = __atomic_load_n(reg, __ATOMIC_RELAXED);
+    while(rank > seen && !__atomic_compare_exchange_n(reg, &seen, rank, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+    }
+}
+
+/**
+* Estimate the number of distinct keys, once the job is done. Small counts
+* use linear counting over the empty registers
+* Parameters:
+*     counter       - Counter of a finished job
+* Return:
+*     double        - Estimated distinct keys
+*/
+double MR_HyperLogLogEstimate(const MR_HyperLogLog *counter){
+    size_t m = (size_t)1 << counter->precision, zeros = 0;
+    double sum = 0;
+    for(size_t i = 0; i < m; i++){
+        sum += 1.0 / (double)((uint64_t)1 << counter->registers[i]); // ranks stay under 64
+        zeros += (counter->registers[i] == 0);
+    }
+    double alpha = (m == 16) ? 0.673 : (m == 32) ? 0.697 : (m == 64) ? 0.709 : 0.7213 / (1 + 1.079 / m);
+    double estimate = alpha * m * m / sum;
+    if(estimate <= 2.5 * m && zeros > 0){
+        estimate = m * log((double)m / zeros);
+    }
+    return estimate;
+}
+
+/**
+* Combiner adding a key to the counter. It emits nothing, so the key never
+* reaches the partitions; the key's values are not read
+*/
+void MR_HyperLogLogCombiner(char *key, unsigned int partition_idx){
+    MR_HyperLogLog *counter = (MR_HyperLogLog *)MR_JobState();
+    assert(counter != NULL);
+    (void)partition_idx;
+    MR_HyperLogLogAdd(counter, key, MR_KeyLength(key));
+}
+
+/**
+* Reducer for keys that reach the partitions, when the job runs without
+* MR_HyperLogLogCombiner
+*/
+void MR_HyperLogLogReducer(char *key, unsigned int partition_idx){
+    MR_HyperLogLogCombiner(key, partition_idx);
+}
+
+#endif
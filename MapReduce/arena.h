@@ -0,0 +1,148 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define ARENA_CHUNK_SIZE (1 << 20)      // Bytes mapped per chunk, larger requests get their own chunk
+#define ARENA_ALIGNMENT sizeof(void *)  // Alignment of every allocation
+#define ARENA_MPOL_PREFERRED 1          // MPOL_PREFERRED of linux/mempolicy.h
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;            // Previously filled chunk
+    size_t size;                        // Bytes mapped, header included
+    size_t used;                        // Bytes handed out, header included
+} ArenaChunk;
+
+typedef struct Arena {
+    ArenaChunk *head;                   // Chunk currently being filled
+    size_t bytes;                       // Bytes handed out by the arena
+    int node;                           // NUMA node chunks are placed on, -1 for the default policy
+} Arena;
+
+typedef struct ArenaStats {
+    unsigned long chunksMapped;         // mmap calls made by all arenas
+    unsigned long chunksUnmapped;       // munmap calls made by all arenas
+} ArenaStats;
+
+ArenaStats arenaStats;
+
+/**
+* Set up an empty arena
+* Parameters:
+*     arena         - Arena to initialize
+*     node          - NUMA node its chunks should come from, -1 to leave
+*                     placement to the kernel's first touch policy
+*/
+void initArena(Arena *arena, int node){
+    arena->head = NULL;
+    arena->bytes = 0;
+    arena->node = node;
+}
+
+/**
+* Ask the kernel to back a fresh mapping with pages of one NUMA node. This is
+* a preference, the kernel falls back to other nodes when the node is full,
+* and failures such as a kernel without NUMA support are ignored
+* Parameters:
+*     memory        - Mapping not touched yet
+*     size          - Bytes of the mapping
+*     node          - Node to place it on
+*/
+void arenaPlace(void *memory, size_t size, int node){
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, memory, size, ARENA_MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0); // the kernel drops the last bit of maxnode
+}
+
+/**
+* Map a new chunk large enough for size bytes and make it the arena's head
+* Parameters:
+*     arena         - Arena to grow
+*     size          - Bytes the next allocation needs
+* Return:
+*     ArenaChunk*   - New chunk, NULL if the mapping failed
+*/
+ArenaChunk *arenaGrow(Arena *arena, size_t size){
+    size_t chunkSize = ARENA_CHUNK_SIZE;
+    if(size + sizeof(ArenaChunk) > chunkSize){
+        size_t page = 4096;
+        chunkSize = (size + sizeof(ArenaChunk) + page - 1) & ~(page - 1);
+    }
+    void *memory = mmap(NULL, chunkSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory == MAP_FAILED){
+        return NULL;
+    }
+    if(arena->node >= 0 && arena->node < (int)(sizeof(unsigned long) * 8)){
+        arenaPlace(memory, chunkSize, arena->node); // before the header below faults in the first page
+    }
+    __atomic_fetch_add(&arenaStats.chunksMapped, 1, __ATOMIC_RELAXED);
+    ArenaChunk *chunk = (ArenaChunk *)memory;
+    chunk->next = arena->head;
+    chunk->size = chunkSize;
+    chunk->used = sizeof(ArenaChunk);
+    arena->head = chunk;
+    return chunk;
+}
+
+/**
+* Bump allocate from an arena. Memory is only released by destroyArena.
+* Running out of memory ends the process here, so callers never see NULL
+* Parameters:
+*     arena         - Arena to allocate from
+*     size          - Bytes requested
+* Return:
+*     void*         - Aligned memory
+*/
+void *arenaAlloc(Arena *arena, size_t size){
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    ArenaChunk *chunk = arena->head;
+    if(chunk == NULL || chunk->used + size > chunk->size){
+        chunk = arenaGrow(arena, size);
+        if(chunk == NULL){
+            perror("arena mmap");
+            exit(EXIT_FAILURE);
+        }
+    }
+    void *memory = (char *)chunk + chunk->used;
+    chunk->used += size;
+    arena->bytes += size;
+    return memory;
+}
+
+/**
+* Copy a string into an arena
+* Parameters:
+*     arena         - Arena to allocate from
+*     str           - String to copy
+*     len           - strlen(str)
+* Return:
+*     char*         - NUL terminated copy
+*/
+char *arenaCopy(Arena *arena, const char *str, size_t len){
+    char *copy = (char *)arenaAlloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/**
+* Unmap every chunk of an arena, leaving it empty and reusable on the same node
+* Parameters:
+*     arena         - Arena to release
+*/
+void destroyArena(Arena *arena){
+    ArenaChunk *chunk = arena->head;
+    while(chunk != NULL){
+        ArenaChunk *next = chunk->next;
+        munmap(chunk, chunk->size);
+        __atomic_fetch_add(&arenaStats.chunksUnmapped, 1, __ATOMIC_RELAXED);
+        chunk = next;
+    }
+    initArena(arena, arena->node);
+}
+
+#endif
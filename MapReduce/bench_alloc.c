@@ -0,0 +1,121 @@
+// Allocation benchmark for the MapReduce framework.
+// Runs a word count over the given files and reports wall time and the
+// number of allocator calls per MR_Run, with and without a combiner.
+// Usage: ./bench_alloc [-n iterations] file...
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "mapreduce.h"
+
+// Count every allocator call in the process (glibc routes its own internal
+// calls, e.g. strdup and getline, through these symbols as well)
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+unsigned long mallocCalls = 0;
+unsigned long freeCalls = 0;
+
+void *malloc(size_t size){
+    __atomic_fetch_add(&mallocCalls, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+void *calloc(size_t count, size_t size){
+    __atomic_fetch_add(&mallocCalls, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+void *realloc(void *ptr, size_t size){
+    __atomic_fetch_add(&mallocCalls, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+void free(void *ptr){
+    if(ptr != NULL){
+        __atomic_fetch_add(&freeCalls, 1, __ATOMIC_RELAXED);
+    }
+    __libc_free(ptr);
+}
+
+unsigned long checksum = 0;
+
+void Map(char *file_name) {
+    FILE *fp = fopen(file_name, "r");
+    assert(fp != NULL);
+
+    char *line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, fp) != -1) {
+        char *token, *dummy = line;
+        while ((token = strsep(&dummy, " \t\n\r")) != NULL) {
+            MR_Emit(token, "1");
+        }
+    }
+    free(line);
+    fclose(fp);
+}
+
+void Combine(char *key, unsigned int partition_idx) {
+    int count = 0;
+    const char *value;
+    char total[32];
+    while ((value = MR_GetNextView(key, partition_idx)) != NULL) {
+        count += atoi(value);
+    }
+    sprintf(total, "%d", count);
+    MR_Emit(key, total);
+}
+
+void Reduce(char *key, unsigned int partition_idx) {
+    unsigned long count = 0;
+    const char *value;
+    while ((value = MR_GetNextView(key, partition_idx)) != NULL) {
+        count += atoi(value);
+    }
+    __atomic_fetch_add(&checksum, count, __ATOMIC_RELAXED);
+}
+
+double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench(const char *label, Combiner combiner, int iterations, int file_count, char *files[]){
+    unsigned long mallocStart = mallocCalls, freeStart = freeCalls;
+#ifdef ARENA_H
+    unsigned long chunksStart = arenaStats.chunksMapped;
+#endif
+    checksum = 0;
+    double start = now();
+    for(int i = 0; i < iterations; i++){
+        MR_RunWithCombiner(file_count, files, Map, combiner, Reduce, 5, 10);
+    }
+    double elapsed = now() - start;
+    printf("%-12s %10.3f ms/run %12lu malloc/run %12lu free/run", label,
+        elapsed * 1000 / iterations, (mallocCalls - mallocStart) / iterations,
+        (freeCalls - freeStart) / iterations);
+#ifdef ARENA_H
+    printf(" %8lu mmap/run", (arenaStats.chunksMapped - chunksStart) / iterations);
+#endif
+    printf("  (%lu words)\n", checksum / iterations);
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = 10;
+    int opt;
+    while((opt = getopt(argc, argv, "n:")) != -1){
+        if(opt == 'n'){
+            iterations = atoi(optarg);
+        }
+    }
+    if(optind >= argc){
+        fprintf(stderr, "Usage: %s [-n iterations] file...\n", argv[0]);
+        return 1;
+    }
+    bench("no-combiner", NULL, iterations, argc - optind, &argv[optind]);
+    bench("combiner", Combine, iterations, argc - optind, &argv[optind]);
+    return 0;
+}
@@ -0,0 +1,457 @@
+// Scaling benchmark for the MapReduce framework.
+// Generates Zipf distributed text corpora and runs distwc's word count over
+// them for every combination of worker count, partition count and file
+// count, reporting map time, reduce time, peak RSS and throughput as CSV on
+// stdout and, optionally, as CSV and JSON files.
+// Usage: ./bench_scale [-s megabytes] [-v vocabulary] [-z exponent] [-r repeats]
+//                      [-w workers,...] [-p parts,...] [-f files,...]
+//                      [-a none|compact|spread] [-d dir] [-c report.csv] [-j report.json] [-k]
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "mapreduce.h"
+#include "reader.h"
+
+#define MAX_SETTINGS 16                 // Values per matrix dimension
+#define WORDS_PER_LINE 12
+
+uint64_t checksum = 0;
+ThreadPool_affinity_t affinity = THREADPOOL_AFFINITY_NONE;
+const char *affinityNames[] = {"none", "compact", "spread"};
+
+void Map(const MR_Split *split) {
+    MR_Reader reader;
+    MR_Token token;
+    if (!MR_ReaderOpen(&reader, split, " \t\n\r")) {
+        perror(split->file_name);
+        return;
+    }
+    while (MR_ReaderNextToken(&reader, &token)) {
+        MR_EmitU64(token.data, token.length, 1);
+    }
+    MR_ReaderClose(&reader);
+}
+
+void Combine(char *key, unsigned int partition_idx) {
+    uint64_t count = 0, value;
+    while (MR_GetNextU64(key, partition_idx, &value)) {
+        count += value;
+    }
+    MR_EmitU64(key, MR_KeyLength(key), count);
+}
+
+void Reduce(char *key, unsigned int partition_idx) {
+    uint64_t count = 0, value;
+    while (MR_GetNextU64(key, partition_idx, &value)) {
+        count += value;
+    }
+    __atomic_fetch_add(&checksum, count, __ATOMIC_RELAXED);
+}
+
+typedef struct Corpus {
+    char dir[4096];                     // Directory holding the files
+    unsigned int fileCount;
+    char **files;
+    size_t bytes;                       // Total size of the files
+    uint64_t words;                     // Words written, what the word count must add up to
+} Corpus;
+
+typedef struct Result {
+    unsigned int files, workers, parts;
+    double wallMs;                      // Submit to MR_Wait returning
+    double mapMs;                       // Submit to the start of the first reduce job
+    double reduceMs;                    // Start of the first reduce job to the end of the last one
+    long peakRssKb;                     // Resident set high water mark during the run
+    uint64_t words;
+} Result;
+
+double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t nextRandom(uint64_t *state){ // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ull;
+}
+
+/**
+* Parse a comma separated list of positive numbers
+* Parameters:
+*     text   - List, e.g. "1,2,4"
+*     values - Array of MAX_SETTINGS entries to fill in
+* Return:
+*     unsigned int - Number of values, 0 if the list is malformed
+*/
+unsigned int parseList(const char *text, unsigned int *values){
+    unsigned int count = 0;
+    while(*text != '\0' && count < MAX_SETTINGS){
+        char *end;
+        unsigned long value = strtoul(text, &end, 10);
+        if(end == text || value == 0 || (*end != ',' && *end != '\0')){
+            return 0;
+        }
+        values[count++] = (unsigned int)value;
+        text = (*end == ',') ? end + 1 : end;
+    }
+    return count;
+}
+
+bool parseAffinity(const char *name){
+    for(int i = THREADPOOL_AFFINITY_NONE; i <= THREADPOOL_AFFINITY_SPREAD; i++){
+        if(strcmp(name, affinityNames[i]) == 0){
+            affinity = (ThreadPool_affinity_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+* Spell a vocabulary rank as a word: bijective base 26, so every rank gets a
+* distinct word and, as in natural text, the frequent words are the short ones
+* Parameters:
+*     rank   - Rank of the word, 0 for the most frequent
+*     word   - At least 16 bytes, NUL terminated on return
+* Return:
+*     size_t - Length of the word
+*/
+size_t rankWord(uint64_t rank, char *word){
+    char reversed[16];
+    size_t length = 0;
+    rank++;
+    while(rank > 0){
+        rank--;
+        reversed[length++] = 'a' + rank % 26;
+        rank /= 26;
+    }
+    for(size_t i = 0; i < length; i++){
+        word[i] = reversed[length - 1 - i];
+    }
+    word[length] = '\0';
+    return length;
+}
+
+/**
+* Write fileCount files of Zipf distributed words adding up to about the given size
+* Parameters:
+*     corpus     - Corpus to fill in, dir must be set and exist
+*     fileCount  - Number of files
+*     bytes      - Total size to write
+*     cdf        - Cumulative probability of each rank
+*     vocabulary - Number of ranks
+*     seed       - Random seed, the same seed gives the same words
+* Return:
+*     true       - On success
+*     false      - Otherwise
+*/
+bool generateCorpus(Corpus *corpus, unsigned int fileCount, size_t bytes, const double *cdf, unsigned int vocabulary, uint64_t seed){
+    corpus->fileCount = fileCount;
+    corpus->files = (char **)calloc(fileCount, sizeof(char *));
+    corpus->bytes = 0;
+    corpus->words = 0;
+    uint64_t state = seed | 1;
+    size_t perFile = bytes / fileCount;
+    char word[16];
+    for(unsigned int f = 0; f < fileCount; f++){
+        size_t pathLength = strlen(corpus->dir) + 32;
+        corpus->files[f] = (char *)malloc(pathLength);
+        snprintf(corpus->files[f], pathLength, "%s/part-%04u.txt", corpus->dir, f);
+        FILE *fp = fopen(corpus->files[f], "w");
+        if(fp == NULL){
+            perror(corpus->files[f]);
+            return false;
+        }
+        size_t written = 0;
+        unsigned int column = 0;
+        while(written < perFile){
+            double u = (nextRandom(&state) >> 11) * (1.0 / 9007199254740992.0);
+            unsigned int low = 0, high = vocabulary - 1;
+            while(low < high){ // first rank whose cumulative probability exceeds u
+                unsigned int middle = low + (high - low) / 2;
+                if(cdf[middle] <= u){
+                    low = middle + 1;
+                }
+                else{
+                    high = middle;
+                }
+            }
+            size_t length = rankWord(low, word);
+            word[length] = (++column == WORDS_PER_LINE) ? '\n' : ' ';
+            if(column == WORDS_PER_LINE){
+                column = 0;
+            }
+            fwrite(word, 1, length + 1, fp);
+            written += length + 1;
+            corpus->words++;
+        }
+        if(column != 0){
+            fputc('\n', fp);
+            written++;
+        }
+        if(fclose(fp) != 0){
+            perror(corpus->files[f]);
+            return false;
+        }
+        corpus->bytes += written;
+    }
+    return true;
+}
+
+void removeCorpus(Corpus *corpus){
+    for(unsigned int f = 0; f < corpus->fileCount; f++){
+        if(corpus->files[f] != NULL){
+            unlink(corpus->files[f]);
+        }
+        free(corpus->files[f]);
+    }
+    free(corpus->files);
+    rmdir(corpus->dir);
+}
+
+/**
+* Reset the resident set high water mark, so each run reports its own peak.
+* Needs Linux 4.0 or later; elsewhere the peak of the whole process is reported
+*/
+void resetPeakRss(){
+    FILE *fp = fopen("/proc/self/clear_refs", "w");
+    if(fp != NULL){
+        fputs("5", fp);
+        fclose(fp);
+    }
+}
+
+long peakRssKb(){
+    FILE *fp = fopen("/proc/self/status", "r");
+    if(fp != NULL){
+        char line[256];
+        long peak = -1;
+        while(fgets(line, sizeof(line), fp) != NULL){
+            if(sscanf(line, "VmHWM: %ld", &peak) == 1){
+                break;
+            }
+        }
+        fclose(fp);
+        if(peak >= 0){
+            return peak;
+        }
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/**
+* Run the word count once on a pool of its own, as MR_RunSplits does, with the
+* pool traced so the map and reduce phases can be told apart from its job spans
+* Parameters:
+*     corpus  - Input
+*     workers - Threads in the pool
+*     parts   - Partitions
+*     result  - Filled in
+*/
+void runOnce(const Corpus *corpus, unsigned int workers, unsigned int parts, Result *result){
+    MR_Options options = MR_DefaultOptions(workers, parts);
+    options.combiner = Combine;
+    options.rebalance = true;
+    checksum = 0;
+    resetPeakRss();
+    ThreadPool_t *pool = ThreadPool_create_affinity(workers, THREADPOOL_SJF, affinity);
+    ThreadPool_set_tracing(pool, true);
+    uint64_t submitted = ThreadPool_now() - pool->startNs;
+    double start = now();
+    MR_Wait(MR_SubmitSplits(pool, corpus->fileCount, corpus->files, Map, Reduce, &options));
+    result->wallMs = (now() - start) * 1000;
+    ThreadPool_check(pool); // spans are recorded after the jobs return
+    // The last map task queues the reducers before it returns, so the phases
+    // meet where the first reducer starts rather than where the last map job ends
+    uint64_t mapEnd = submitted, reduceStart = UINT64_MAX, reduceEnd = 0;
+    for(int i = 0; i < pool->num_workers; i++){
+        ThreadPool_worker_t *worker = &pool->workers[i];
+        for(size_t j = 0; j < worker->spanCount; j++){
+            ThreadPool_span_t *span = &worker->spans[j];
+            uint64_t end = span->start + span->duration;
+            if(span->kind != JOB_REDUCE){
+                mapEnd = (end > mapEnd) ? end : mapEnd;
+            }
+            else{
+                reduceStart = (span->start < reduceStart) ? span->start : reduceStart;
+                reduceEnd = (end > reduceEnd) ? end : reduceEnd;
+            }
+        }
+    }
+    if(reduceStart == UINT64_MAX){
+        reduceStart = reduceEnd = mapEnd;
+    }
+    ThreadPool_destroy(pool);
+    result->files = corpus->fileCount;
+    result->workers = workers;
+    result->parts = parts;
+    result->mapMs = (reduceStart - submitted) / 1e6;
+    result->reduceMs = (reduceEnd - reduceStart) / 1e6;
+    result->peakRssKb = peakRssKb();
+    result->words = checksum;
+}
+
+int compareWallTimes(const void *a, const void *b){
+    const Result *x = (const Result *)a, *y = (const Result *)b;
+    return (x->wallMs > y->wallMs) - (x->wallMs < y->wallMs);
+}
+
+void printCsvHeader(FILE *stream){
+    fprintf(stream, "files,workers,parts,input_mb,words,wall_ms,map_ms,reduce_ms,peak_rss_kb,throughput_mb_s\n");
+}
+
+void printCsvRow(FILE *stream, const Result *result, double megabytes){
+    fprintf(stream, "%u,%u,%u,%.2f,%" PRIu64 ",%.2f,%.2f,%.2f,%ld,%.2f\n", result->files, result->workers, result->parts,
+        megabytes, result->words, result->wallMs, result->mapMs, result->reduceMs, result->peakRssKb,
+        megabytes * 1000 / result->wallMs);
+}
+
+void printJsonRow(FILE *stream, const Result *result, double megabytes, bool first){
+    fprintf(stream, "%s\n    {\"files\": %u, \"workers\": %u, \"parts\": %u, \"input_mb\": %.2f, \"words\": %" PRIu64
+        ", \"wall_ms\": %.2f, \"map_ms\": %.2f, \"reduce_ms\": %.2f, \"peak_rss_kb\": %ld, \"throughput_mb_s\": %.2f}",
+        first ? "" : ",", result->files, result->workers, result->parts, megabytes, result->words, result->wallMs,
+        result->mapMs, result->reduceMs, result->peakRssKb, megabytes * 1000 / result->wallMs);
+}
+
+int main(int argc, char *argv[]) {
+    size_t megabytes = 64;
+    unsigned int vocabulary = 100000, repeats = 3;
+    double exponent = 1.0;
+    unsigned int workers[MAX_SETTINGS] = {1, 2, 4, 8}, parts[MAX_SETTINGS] = {4, 16}, files[MAX_SETTINGS] = {1, 16};
+    unsigned int workerCount = 4, partCount = 2, fileCount = 2;
+    const char *dir = NULL, *csvPath = NULL, *jsonPath = NULL;
+    bool keep = false;
+    int opt;
+    while((opt = getopt(argc, argv, "s:v:z:r:w:p:f:a:d:c:j:k")) != -1){
+        switch(opt){
+            case 's': megabytes = strtoul(optarg, NULL, 10); break;
+            case 'v': vocabulary = strtoul(optarg, NULL, 10); break;
+            case 'z': exponent = atof(optarg); break;
+            case 'r': repeats = strtoul(optarg, NULL, 10); break;
+            case 'w': workerCount = parseList(optarg, workers); break;
+            case 'p': partCount = parseList(optarg, parts); break;
+            case 'f': fileCount = parseList(optarg, files); break;
+            case 'a':
+                if(!parseAffinity(optarg)){
+                    workerCount = 0;
+                }
+                break;
+            case 'd': dir = optarg; break;
+            case 'c': csvPath = optarg; break;
+            case 'j': jsonPath = optarg; break;
+            case 'k': keep = true; break;
+            default: workerCount = 0;
+        }
+    }
+    if(megabytes == 0 || vocabulary == 0 || repeats == 0 || exponent <= 0 || workerCount == 0 || partCount == 0 || fileCount == 0){
+        fprintf(stderr, "Usage: %s [-s megabytes] [-v vocabulary] [-z exponent] [-r repeats]\n"
+                        "       [-w workers,...] [-p parts,...] [-f files,...] [-a none|compact|spread]\n"
+                        "       [-d dir] [-c report.csv] [-j report.json] [-k]\n", argv[0]);
+        return 1;
+    }
+    if(dir == NULL){
+        dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    }
+    FILE *csv = NULL, *json = NULL;
+    if(csvPath != NULL && (csv = fopen(csvPath, "w")) == NULL){
+        perror(csvPath);
+        return 1;
+    }
+    if(jsonPath != NULL && (json = fopen(jsonPath, "w")) == NULL){
+        perror(jsonPath);
+        return 1;
+    }
+
+    // P(rank k) proportional to 1 / (k + 1)^exponent
+    double *cdf = (double *)malloc(sizeof(double) * vocabulary);
+    double total = 0;
+    for(unsigned int k = 0; k < vocabulary; k++){
+        total += pow(k + 1, -exponent);
+        cdf[k] = total;
+    }
+    for(unsigned int k = 0; k < vocabulary; k++){
+        cdf[k] /= total;
+    }
+
+    printCsvHeader(stdout);
+    if(csv != NULL){
+        printCsvHeader(csv);
+    }
+    if(json != NULL){
+        fprintf(json, "{\n  \"corpus\": {\"megabytes\": %zu, \"vocabulary\": %u, \"exponent\": %g, \"repeats\": %u, \"affinity\": \"%s\"},\n  \"runs\": [",
+            megabytes, vocabulary, exponent, repeats, affinityNames[affinity]);
+    }
+    Result *results = (Result *)malloc(sizeof(Result) * repeats);
+    bool ok = true, first = true;
+    for(unsigned int f = 0; f < fileCount && ok; f++){
+        Corpus corpus;
+        snprintf(corpus.dir, sizeof(corpus.dir), "%s/bench_scale.XXXXXX", dir);
+        if(mkdtemp(corpus.dir) == NULL){
+            perror(corpus.dir);
+            ok = false;
+            break;
+        }
+        double start = now();
+        if(!generateCorpus(&corpus, files[f], megabytes << 20, cdf, vocabulary, 0x9e3779b97f4a7c15ull)){
+            removeCorpus(&corpus);
+            ok = false;
+            break;
+        }
+        fprintf(stderr, "generated %u files, %.1f MB, %" PRIu64 " words in %.2f s (%s)\n", files[f],
+            corpus.bytes / 1048576.0, corpus.words, now() - start, corpus.dir);
+        double inputMb = corpus.bytes / 1048576.0;
+        for(unsigned int w = 0; w < workerCount && ok; w++){
+            for(unsigned int p = 0; p < partCount && ok; p++){
+                for(unsigned int r = 0; r < repeats; r++){
+                    runOnce(&corpus, workers[w], parts[p], &results[r]);
+                    if(results[r].words != corpus.words){
+                        fprintf(stderr, "word count mismatch: counted %" PRIu64 ", generated %" PRIu64 "\n",
+                            results[r].words, corpus.words);
+                        ok = false;
+                    }
+                }
+                qsort(results, repeats, sizeof(Result), compareWallTimes);
+                Result *median = &results[repeats / 2];
+                printCsvRow(stdout, median, inputMb);
+                fflush(stdout);
+                if(csv != NULL){
+                    printCsvRow(csv, median, inputMb);
+                }
+                if(json != NULL){
+                    printJsonRow(json, median, inputMb, first);
+                }
+                first = false;
+            }
+        }
+        if(keep){
+            for(unsigned int i = 0; i < corpus.fileCount; i++){
+                free(corpus.files[i]);
+            }
+            free(corpus.files);
+        }
+        else{
+            removeCorpus(&corpus);
+        }
+    }
+    if(json != NULL){
+        fprintf(json, "\n  ]\n}\n");
+        fclose(json);
+    }
+    if(csv != NULL){
+        fclose(csv);
+    }
+    free(results);
+    free(cdf);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,166 @@
+// Tokenizer benchmark for the MapReduce framework.
+// Loads the given files into memory and tokenizes them over and over until
+// the requested volume has been scanned, comparing the getline + strsep loop
+// distwc used to run against each tokenizer.h scanner.
+// Usage: ./bench_tokenize [-s megabytes] file...
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "tokenizer.h"
+
+#define DELIMITERS " \t\n\r"
+
+typedef struct Count {
+    unsigned long tokens;               // Non-empty tokens
+    unsigned long empty;                // Empty tokens, strsep only
+    unsigned long bytes;                // Bytes in the tokens
+} Count;
+
+double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+* Read every file into one buffer, separating the files with a newline
+* Parameters:
+*     file_count - Number of files
+*     files      - File names
+*     length     - Set to the bytes read
+* Return:
+*     char* - Buffer, NULL if a file could not be read
+*/
+char *loadCorpus(int file_count, char *files[], size_t *length){
+    char *corpus = NULL;
+    *length = 0;
+    for(int i = 0; i < file_count; i++){
+        FILE *fp = fopen(files[i], "rb");
+        if(fp == NULL){
+            perror(files[i]);
+            free(corpus);
+            return NULL;
+        }
+        fseek(fp, 0, SEEK_END);
+        long size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        corpus = (char *)realloc(corpus, *length + size + 1);
+        *length += fread(corpus + *length, 1, size, fp);
+        corpus[(*length)++] = '\n';
+        fclose(fp);
+    }
+    return corpus;
+}
+
+// The old mapper loop: copy each line out as getline does, then strsep it
+void countStrsep(const char *corpus, size_t length, Count *count){
+    static char *line = NULL;
+    static size_t capacity = 0;
+    const char *end = corpus + length;
+    for(const char *p = corpus; p < end;){
+        const char *newline = (const char *)memchr(p, '\n', end - p);
+        size_t lineLength = (newline != NULL ? newline + 1 : end) - p;
+        if(lineLength + 1 > capacity){
+            capacity = 2 * (lineLength + 1);
+            line = (char *)realloc(line, capacity);
+        }
+        memcpy(line, p, lineLength);
+        line[lineLength] = '\0';
+        p += lineLength;
+        char *token, *dummy = line;
+        while((token = strsep(&dummy, DELIMITERS)) != NULL){
+            size_t tokenLength = strlen(token);
+            if(tokenLength == 0){
+                count->empty++;
+            }
+            else{
+                count->tokens++;
+                count->bytes += tokenLength;
+            }
+        }
+    }
+}
+
+void countTokenizer(const MR_Tokenizer *tokenizer, const char *corpus, size_t length, Count *count){
+    const char *cursor = corpus;
+    MR_ScanBlock block = {NULL, 0};
+    MR_Token token;
+    while(MR_NextToken(tokenizer, &block, &cursor, corpus + length, &token)){
+        count->tokens++;
+        count->bytes += token.length;
+    }
+}
+
+/**
+* Scan the corpus until at least target bytes have been processed
+* Parameters:
+*     label     - Row name
+*     tokenizer - Tokenizer to use, NULL for the strsep loop
+*     corpus    - Input
+*     length    - Bytes in the input
+*     target    - Bytes to scan in total
+*     reference - Token count of one pass to check against, 0 to skip the check
+* Return:
+*     unsigned long - Non-empty tokens in one pass
+*/
+unsigned long bench(const char *label, const MR_Tokenizer *tokenizer, const char *corpus, size_t length, double target, unsigned long reference){
+    Count count = {0, 0, 0};
+    unsigned long passes = 0;
+    double start = now();
+    do{
+        if(tokenizer == NULL){
+            countStrsep(corpus, length, &count);
+        }
+        else{
+            countTokenizer(tokenizer, corpus, length, &count);
+        }
+        passes++;
+    }while((double)passes * length < target);
+    double elapsed = now() - start;
+    double megabytes = (double)passes * length / (1 << 20);
+    printf("%-8s %10.1f MB %9.3f s %9.1f MB/s %12lu tokens/pass %10lu empty/pass\n", label,
+        megabytes, elapsed, megabytes / elapsed, count.tokens / passes, count.empty / passes);
+    if(reference != 0 && count.tokens / passes != reference){
+        fprintf(stderr, "%s: token count %lu does not match %lu\n", label, count.tokens / passes, reference);
+        exit(1);
+    }
+    return count.tokens / passes;
+}
+
+int main(int argc, char *argv[]) {
+    double target = 4096.0 * (1 << 20);
+    int opt;
+    while((opt = getopt(argc, argv, "s:")) != -1){
+        if(opt == 's'){
+            target = atof(optarg) * (1 << 20);
+        }
+    }
+    if(optind >= argc){
+        fprintf(stderr, "Usage: %s [-s megabytes] file...\n", argv[0]);
+        return 1;
+    }
+    size_t length;
+    char *corpus = loadCorpus(argc - optind, &argv[optind], &length);
+    if(corpus == NULL || length == 0){
+        return 1;
+    }
+
+    MR_Tokenizer tokenizer;
+    MR_TokenizerInit(&tokenizer, DELIMITERS);
+    MR_TokenizerLevel best = tokenizer.level;
+    unsigned long tokens = bench("strsep", NULL, corpus, length, target, 0);
+    tokenizer.level = TOKENIZER_SCALAR;
+    bench("scalar", &tokenizer, corpus, length, target, tokens);
+    if(best >= TOKENIZER_SSE2){
+        tokenizer.level = TOKENIZER_SSE2;
+        bench("sse2", &tokenizer, corpus, length, target, tokens);
+    }
+    if(best >= TOKENIZER_AVX2){
+        tokenizer.level = TOKENIZER_AVX2;
+        bench("avx2", &tokenizer, corpus, length, target, tokens);
+    }
+    free(corpus);
+    return 0;
+}
@@ -1,38 +1,90 @@
 #include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "mapreduce.h"
+#include "aggregate.h"
+#include "multiprocess.h"
+#include "reader.h"
 
-void Map(char *file_name) {
-    FILE *fp = fopen(file_name, "r");
-    assert(fp != NULL);
+void Map(const MR_Split *split) {
+    MR_Reader reader;
+    MR_Token token;
+    if (!MR_ReaderOpen(&reader, split, " \t\n\r")) {
+        perror(split->file_name);
+        return;
+    }
+    while (MR_ReaderNextToken(&reader, &token)) {
+        MR_EmitU64(token.data, token.length, 1);
+    }
+    MR_ReaderClose(&reader);
+}
 
-    char *line = NULL;
-    size_t size = 0;
-    while (getline(&line, &size, fp) != -1) {
-        char *token, *dummy = line;
-        while ((token = strsep(&dummy, " \t\n\r")) != NULL) {
-            MR_Emit(token, "1");
-        }
+void Combine(char *key, unsigned int partition_idx) {
+    uint64_t count = 0, value;
+    while (MR_GetNextU64(key, partition_idx, &value)) {
+        count += value;
     }
-    free(line);
-    fclose(fp);
+    MR_EmitU64(key, MR_KeyLength(key), count);
 }
 
 void Reduce(char *key, unsigned int partition_idx) {
-    int count = 0;
-    char *value, name[100];
-    while ((value = MR_GetNext(key, partition_idx)) != NULL) {
-        count++;
-        free(value);
+    uint64_t count = 0, value;
+    while (MR_GetNextU64(key, partition_idx, &value)) {
+        count += value;
+    }
+    MR_Printf(partition_idx, "%s: %" PRIu64 "\n", key, count);
+}
+
+// Parse the positive integer in environment variable name, false with a usage error otherwise
+bool parseCount(const char *name, const char *text, unsigned int *value) {
+    char *end;
+    errno = 0;
+    unsigned long parsed = strtoul(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0' || strchr(text, '-') != NULL || parsed == 0 || parsed > UINT_MAX) {
+        fprintf(stderr, "%s must be a positive integer up to %u, got \"%s\"\n", name, UINT_MAX, text);
+        return false;
     }
-    sprintf(name, "result-%d.txt", partition_idx);
-    FILE *fp = fopen(name, "a");
-    fprintf(fp, "%s: %d\n", key, count);
-    fclose(fp);
+    *value = (unsigned int)parsed;
+    return true;
 }
 
 int main(int argc, char *argv[]) {
-    MR_Run(argc - 1, &(argv[1]), Map, Reduce, 5, 10);
+    MR_Options options = MR_DefaultOptions(5, 10);
+    options.combiner = Combine;
+    options.rebalance = true;
+    // MR_CACHE_DIR=dir keeps each input's combined counts, so a rerun only maps new or changed files
+    options.cache_dir = getenv("MR_CACHE_DIR");
+    options.cache_tag = "distwc word counts v1"; // bump when Map or Combine change
+    // MR_TOP_K=k prints the k most frequent words instead of writing every count
+    const char *topK = getenv("MR_TOP_K");
+    if (topK != NULL) {
+        unsigned int k, count;
+        if (!parseCount("MR_TOP_K", topK, &k)) {
+            return 1;
+        }
+        MR_TopK *top = MR_TopKCreate(k, options.num_parts);
+        options.combiner = MR_SumCombiner;
+        options.job_state = top;
+        MR_RunSplits(argc - 1, &(argv[1]), Map, MR_TopKReducer, &options);
+        const MR_TopKEntry *entries = MR_TopKResult(top, &count);
+        for (unsigned int i = 0; i < count; i++) {
+            printf("%s: %" PRIu64 "\n", entries[i].key, entries[i].count);
+        }
+        MR_TopKDestroy(top);
+        return 0;
+    }
+    // MR_PROCESSES=n runs the job over n worker processes instead of one pool
+    const char *processes = getenv("MR_PROCESSES");
+    if (processes != NULL) {
+        unsigned int count;
+        if (!parseCount("MR_PROCESSES", processes, &count)) {
+            return 1;
+        }
+        return MR_RunProcesses(argc - 1, &(argv[1]), Map, Reduce, &options, count) ? 0 : 1;
+    }
+    MR_RunSplits(argc - 1, &(argv[1]), Map, Reduce, &options);
 }
\ No newline at end of file
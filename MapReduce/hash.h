@@ -0,0 +1,88 @@
+#ifndef HASH_H
+#define HASH_H
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// 64-bit key hash following wyhash (Wang Yi, public domain): the input is
+// read 8 or 16 bytes at a time and mixed with 64x64->128 bit multiplies,
+// so short keys such as words cost a couple of multiplies instead of a
+// multiply and an add per byte
+
+#define HASH_SECRET0 0xa0761d6478bd642full
+#define HASH_SECRET1 0xe7037ed1a0b428dbull
+#define HASH_SECRET2 0x8ebc6af09c88c6e3ull
+#define HASH_SECRET3 0x589965cc75374cc3ull
+
+static inline uint64_t hashMix(uint64_t a, uint64_t b){
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t hashRead64(const unsigned char *p){
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t hashRead32(const unsigned char *p){
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/**
+* Hash a byte string
+* Parameters:
+*     data          - Bytes to hash, need not be NUL terminated
+*     length        - Number of bytes
+*     seed          - Varies the hash function, 0 for the framework's keys
+* Return:
+*     uint64_t      - Hash of the bytes
+*/
+uint64_t hashBytes(const void *data, size_t length, uint64_t seed){
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t a, b;
+    seed ^= hashMix(seed ^ HASH_SECRET0, HASH_SECRET1);
+    if(length <= 16){
+        if(length >= 4){ // two possibly overlapping 4 byte reads from each end
+            size_t middle = (length >> 3) << 2;
+            a = (hashRead32(p) << 32) | hashRead32(p + middle);
+            b = (hashRead32(p + length - 4) << 32) | hashRead32(p + length - 4 - middle);
+        }
+        else if(length > 0){
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) | p[length - 1];
+            b = 0;
+        }
+        else{
+            a = b = 0;
+        }
+    }
+    else{
+        size_t left = length;
+        if(left > 48){ // three independent lanes
+            uint64_t lane1 = seed, lane2 = seed;
+            do{
+                seed = hashMix(hashRead64(p) ^ HASH_SECRET1, hashRead64(p + 8) ^ seed);
+                lane1 = hashMix(hashRead64(p + 16) ^ HASH_SECRET2, hashRead64(p + 24) ^ lane1);
+                lane2 = hashMix(hashRead64(p + 32) ^ HASH_SECRET3, hashRead64(p + 40) ^ lane2);
+                p += 48;
+                left -= 48;
+            } while(left > 48);
+            seed ^= lane1 ^ lane2;
+        }
+        while(left > 16){
+            seed = hashMix(hashRead64(p) ^ HASH_SECRET1, hashRead64(p + 8) ^ seed);
+            p += 16;
+            left -= 16;
+        }
+        a = hashRead64(p + left - 16);
+        b = hashRead64(p + left - 8);
+    }
+    __uint128_t product = (__uint128_t)(a ^ HASH_SECRET1) * (b ^ seed);
+    a = (uint64_t)product;
+    b = (uint64_t)(product >> 64);
+    return hashMix(a ^ HASH_SECRET0 ^ length, b ^ HASH_SECRET1);
+}
+
+#endif
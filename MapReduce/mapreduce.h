@@ -3,167 +3,1897 @@
 
 
 #include "threadpool.h"
+#include "arena.h"
+#include "output.h"
+#include "spill.h"
+#include "hash.h"
 #include <string.h>
 #include <assert.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+
+#define MR_DEFAULT_SPLIT_SIZE (64 << 20)    // Bytes per map task when splitting input files
+#define MR_REBALANCE_SLOTS 8                // Hash slots per partition when rebalancing
+#define MR_COMPACT_RUNS 8                   // Pipeline mode: runs a partition collects before they are merged early
+#define MR_DEFAULT_OUTPUT_FORMAT "result-%u.txt" // Output file of each partition, formatted with its index
+
+typedef struct MR_Split {
+    char *file_name;                        // File the split belongs to
+    off_t offset;                           // First byte of the split, 0 or just after a newline
+    size_t length;                          // Bytes in the split, ends on a newline or at end of file
+} MR_Split;
+
 // function pointer typedefs
 typedef void (*Mapper)(char *file_name);
+typedef void (*SplitMapper)(const MR_Split *split);
 typedef void (*Reducer)(char *key, unsigned int partition_idx);
+// Combiners read values with MR_GetNext and write with MR_Emit exactly like a
+// reducer, but only see one map task's values and must emit under the same key
+typedef void (*Combiner)(char *key, unsigned int partition_idx);
+
+// library functions that must be implemented
+typedef struct KeyValue {
+    char *key;
+    char *value;
+    struct KeyValue *next;                      // Linked List 
+} KeyValue;
+
+// Every key stored in a run or a decoded spill group is preceded by its hash
+// and length, so keys from different runs are told apart without reading them
+typedef struct KeyHeader {
+    uint64_t hash;                          // MR_HashBytes of the key
+    size_t length;                          // Bytes in the key
+} KeyHeader;
+
+#define MR_KEY_HEADER(key) ((const KeyHeader *)((key) - sizeof(KeyHeader)))
+#define MR_KEY_SPACE(length) (sizeof(KeyHeader) + _Alignof(KeyHeader) - 1 + (length) + 1) // header, alignment, key and NUL
+
+/**
+* Copy a key into run text behind an aligned KeyHeader
+* Parameters:
+*     text          - Write position, moved past the key's NUL
+*     key           - Key bytes, need not be NUL terminated
+*     length        - Bytes in the key
+*     hash          - MR_HashBytes(key, length)
+* Return:
+*     char*         - The stored key
+*/
+char *storeKey(char **text, const char *key, size_t length, uint64_t hash){
+    uintptr_t at = ((uintptr_t)*text + _Alignof(KeyHeader) - 1) & ~(uintptr_t)(_Alignof(KeyHeader) - 1);
+    KeyHeader *header = (KeyHeader *)at;
+    header->hash = hash;
+    header->length = length;
+    char *stored = (char *)(header + 1);
+    memcpy(stored, key, length);
+    stored[length] = '\0';
+    *text = stored + length + 1;
+    return stored;
+}
+
+// Every stored value is preceded by its length, so values may hold any bytes,
+// NUL included. Lengths under MR_VALUE_LONG take one byte; longer values are
+// framed as MR_VALUE_LONG, a 32-bit length and MR_VALUE_LONG again, so the
+// length can be read both forwards (spill files) and backwards from the value.
+// A NUL still follows the bytes so text values read as C strings
+#define MR_VALUE_LONG 0xFF
+#define MR_VALUE_HEADER(length) ((length) < MR_VALUE_LONG ? 1 : 2 + sizeof(uint32_t))
+#define MR_VALUE_SPACE(length) (MR_VALUE_HEADER(length) + (length) + 1) // header, value and NUL
+
+/**
+* Copy a value into run text behind its length
+* Parameters:
+*     text          - Write position, moved past the value's NUL
+*     value         - Value bytes
+*     length        - Bytes in the value, under 4 GB
+* Return:
+*     char*         - The stored value
+*/
+char *storeValue(char **text, const void *value, size_t length){
+    unsigned char *at = (unsigned char *)*text;
+    if(length < MR_VALUE_LONG){
+        *at++ = (unsigned char)length;
+    }
+    else{
+        uint32_t longLength = (uint32_t)length;
+        *at++ = MR_VALUE_LONG;
+        memcpy(at, &longLength, sizeof(longLength));
+        at += sizeof(longLength);
+        *at++ = MR_VALUE_LONG;
+    }
+    memcpy(at, value, length);
+    at[length] = '\0';
+    *text = (char *)at + length + 1;
+    return (char *)at;
+}
+
+/**
+* Length of a value handed out by MR_GetNextView or MR_GetNextBytes, which
+* may contain NUL bytes
+* Parameters:
+*     value         - Value stored by the framework
+* Return:
+*     size_t        - Bytes in the value, NUL terminator excluded
+*/
+size_t MR_ValueLength(const char *value){
+    unsigned char last = (unsigned char)value[-1];
+    if(last != MR_VALUE_LONG){
+        return last;
+    }
+    uint32_t length;
+    memcpy(&length, value - 1 - sizeof(length), sizeof(length));
+    return length;
+}
+
+/**
+* Length of a key handed to a combiner or reducer, for binary keys that may
+* contain NUL bytes
+* Parameters:
+*     key           - Key stored by the framework
+* Return:
+*     size_t        - Bytes in the key, NUL terminator excluded
+*/
+size_t MR_KeyLength(const char *key){
+    return MR_KEY_HEADER(key)->length;
+}
+
+// One map task's output for one partition: a single allocation holding the
+// records sorted by key followed by the key and value bytes
+typedef struct Run {
+    struct Run *next;                       // Next run published to the same partition
+    KeyValue *records;                      // Sorted by key, values of a key are adjacent and share one key copy
+    size_t count;
+    size_t bytes;                           // Size of the allocation, counted against the memory budget
+} Run;
+
+// Runs merged and written to a temporary file once a partition went over its
+// memory budget. The file is a sequence of key groups in key order:
+// varint key length, varint value count, varint value bytes, the key bytes,
+// then the values framed as in memory: length, bytes and NUL. Runs loaded
+// from the map output cache are a range of a cache file in the same format
+typedef struct Spill {
+    struct Spill *next;                     // Next spill of the same partition
+    int fd;                                 // Unlinked temporary file, closed once the partition is reduced. -1 until a cache file is opened
+    char *path;                             // Cache file holding the run, NULL for a temporary file
+    off_t offset;                           // File offset of the run
+    size_t length;                          // Bytes in the run
+} Spill;
+
+typedef struct SpillCursor {
+    SpillInput input;
+    char *groups[2];                        // Decoded key groups; the previous one stays valid while the next is read
+    size_t capacity[2];
+    unsigned int current;
+} SpillCursor;
+
+typedef struct RunCursor {
+    KeyValue *next;                         // Next unread record of a run, or of the spill's current key group
+    KeyValue *end;
+    SpillCursor *spill;                     // NULL for a run held in memory
+} RunCursor;
+
+typedef struct Merge {
+    RunCursor *heap;                        // Min-heap of run cursors ordered by their next key
+    unsigned int count;                     // Cursors in the heap
+    unsigned int total;                     // Cursors allocated, finished ones are parked after the heap
+    char *key;                              // Key being reduced, stored in one of the runs
+} Merge;
+
+typedef struct Bucket{
+    Run *runs;                              // Sorted runs of the map tasks, pushed without a lock
+    Spill *spills;                          // Runs moved to disk, pushed without a lock
+    size_t size;                            // Records in all runs and spills
+    size_t memoryBytes;                     // Bytes held by runs
+    size_t spillBytes;                      // Bytes written to spill files
+    unsigned int runCount;                  // Runs held in memory
+    int merging;                            // Set while a task merges the partition's runs, to disk or in memory
+    int compactQueued;                      // Set while a compaction job for the partition is waiting to run
+    Merge merge;                            // k-way merge of runs and spills while the slot is being reduced
+    struct MR_Job *job;                     // Job the slot belongs to
+} Bucket;
+
+typedef struct MR_PartitionStats {
+    size_t records;                         // Pairs handed to the reducer, after combining
+    size_t bytes;                           // Bytes of runs and spill files
+    size_t spillBytes;                      // Part of bytes that was spilled to disk
+    unsigned int slots;                     // Hash slots assigned to the partition
+} MR_PartitionStats;
+
+typedef struct MR_Job MR_Job;
+
+typedef struct MapTaskArgs {
+    MR_Job *job;
+    MR_Split *split;                        // Handed to the mapper
+} MapTaskArgs;
+
+// Everything one MapReduce job owns. Jobs never share state, so several can
+// run at once on one pool; tasks find their job through threadJob
+struct MR_Job{
+    Bucket ** bucket;                       // One per hash slot
+    unsigned int numSlots;                  // Keys are hashed to slots, numParts times the slots per partition
+    unsigned int numParts;
+    unsigned int *slotPartition;            // Partition reducing each slot, fixed when the map phase ends
+    Bucket **reducing;                      // Slot each partition's reducer is working through
+    Output *output;                         // Written by a partition's reducer through MR_Write / MR_Printf
+    MR_PartitionStats *stats;               // Filled in when the map phase ends
+    Mapper mapper;                          // Map function run by every MR_MapTask
+    SplitMapper splitMapper;                // Used instead of mapper for jobs started with MR_RunSplits
+    Combiner combiner;                      // Optional, run on each map task's output before it is flushed
+    size_t memoryBudget;                    // Bytes of runs a partition may hold before they are spilled, 0 for no limit
+    const char *spillDir;                   // Directory for spill files
+    const char *cacheDir;                   // Directory of the map output cache, NULL if off
+    const char *cacheTag;                   // Names the mapper and combiner that wrote the cache
+    bool pipeline;                          // Merge runs while map tasks are still running
+    ThreadPool_latch_t mapped;              // Map and compaction jobs, the one opening it queues the reducers
+    ThreadPool_latch_t reduced;             // Reduce jobs plus one for the seal, MR_Wait sleeps on it
+    ThreadPool_t *pool;                     // Pool running the job
+    Reducer reducer;
+    MR_Split *splits;                       // Input of the map tasks
+    MapTaskArgs *mapArgs;
+    MR_PartitionStats *statsOut;            // MR_Options.partition_stats, copied to by MR_Wait
+    void *state;                            // MR_Options.job_state, returned by MR_JobState
+};
+
+__thread MR_Job *threadJob = NULL;          // Job of the map or reduce task the calling thread is running
+
+#define EMIT_BUFFER_INITIAL_CAPACITY 1024   // Slots in a fresh emit buffer (power of two)
+
+typedef struct EmitEntry {
+    char *key;                              // Key shared by every value in the entry, NULL if the slot is free
+    size_t keyLength;                       // Bytes in the key
+    unsigned long hash;                     // Cached hash of the key
+    KeyValue *head;                         // Values emitted for this key during the current map task
+    KeyValue *tail;
+    size_t count;
+    size_t valueBytes;                      // MR_VALUE_SPACE of the values
+} EmitEntry;
+
+typedef struct EmitBuffer {
+    EmitEntry *slots;                       // Open addressing hash table of emitted keys
+    size_t capacity;                        // Always a power of two
+    size_t used;
+    Arena arena;                            // Backs the buffered nodes, interned keys and values
+} EmitBuffer;
+
+__thread EmitBuffer *threadEmitBuffer = NULL;   // Set while the calling thread is running a map task
+
+typedef struct CombineState {
+    char *key;                              // Key being combined
+    size_t keyLength;                       // Bytes in the key
+    Arena *arena;                           // Backs the pairs emitted by the combiner
+    KeyValue *input;                        // Values buffered for the key
+    KeyValue *next;                         // Next value handed out by MR_GetNext
+    KeyValue *head;                         // Pairs emitted by the combiner
+    KeyValue *tail;
+    size_t count;
+    size_t valueBytes;
+} CombineState;
+
+__thread CombineState *threadCombineState = NULL; // Set while the calling thread is running a combiner
+
+/**
+* Allocate a run with room for its records and text
+* Parameters:
+*     count         - Number of records
+*     bytes         - Bytes of key and value text, NUL terminators included
+* Return:
+*     Run*          - New run, records and text uninitialised
+*/
+Run *allocRun(size_t count, size_t bytes){
+    Run *run = (Run *)malloc(sizeof(Run) + count * sizeof(KeyValue) + bytes);
+    run->next = NULL;
+    run->records = (KeyValue *)(run + 1);
+    run->count = count;
+    run->bytes = sizeof(Run) + count * sizeof(KeyValue) + bytes;
+    return run;
+}
+
+void freeRuns(Run *run){
+    while(run != NULL){
+        Run *next = run->next;
+        free(run);
+        run = next;
+    }
+}
+
+void mergeDestroy(Merge *merge);
+
+/**
+* Release everything a partition holds: its runs, its spill files and the
+* state of its merge
+* Parameters:
+*     bucket        - Partition to empty
+*/
+void releasePartition(Bucket *bucket){
+    mergeDestroy(&bucket->merge);
+    freeRuns(bucket->runs);
+    bucket->runs = NULL;
+    Spill *spill = bucket->spills;
+    while(spill != NULL){
+        Spill *next = spill->next;
+        if(spill->fd >= 0){
+            close(spill->fd);
+        }
+        free(spill->path);
+        free(spill);
+        spill = next;
+    }
+    bucket->spills = NULL;
+    bucket->size = 0;
+    bucket->memoryBytes = 0;
+    bucket->spillBytes = 0;
+    bucket->runCount = 0;
+}
+
+/**
+* Set up a job's partitions and their hash slots. Every partition starts out
+* with slots_per_part slots, slot i belonging to partition i % num_parts
+* Parameters:
+*     job            - Job to set up
+*     num_parts      - Number of partitions
+*     slots_per_part - Hash slots per partition, more than 1 lets MR_SubmitReducers rebalance them
+*     output_format  - printf format of a partition's output file
+*/
+void initPartitions(MR_Job *job, unsigned int num_parts, unsigned int slots_per_part, const char *output_format){
+    char path[PATH_MAX];
+    job->numParts = num_parts;
+    job->numSlots = num_parts * slots_per_part;
+    job->bucket = (Bucket **)malloc(job->numSlots * sizeof(Bucket *));
+    job->slotPartition = (unsigned int *)malloc(job->numSlots * sizeof(unsigned int));
+    for(unsigned int i =0; i < job->numSlots; i++){
+        job->bucket[i] = (Bucket *)malloc(sizeof(Bucket ));
+        job->bucket[i]->runs = NULL; // sets bucket/partition to empty
+        job->bucket[i]->spills = NULL;
+        job->bucket[i]->size = 0;
+        job->bucket[i]->memoryBytes = 0;
+        job->bucket[i]->spillBytes = 0;
+        job->bucket[i]->runCount = 0;
+        job->bucket[i]->merging = 0;
+        job->bucket[i]->compactQueued = 0;
+        job->bucket[i]->merge.heap = NULL;
+        job->bucket[i]->merge.count = 0;
+        job->bucket[i]->merge.total = 0;
+        job->bucket[i]->job = job;
+        job->slotPartition[i] = i % num_parts;
+    }
+    job->reducing = (Bucket **)calloc(num_parts, sizeof(Bucket *));
+    job->output = (Output *)malloc(num_parts * sizeof(Output));
+    job->stats = (MR_PartitionStats *)calloc(num_parts, sizeof(MR_PartitionStats));
+    for(unsigned int i =0; i < num_parts; i++){
+        snprintf(path, sizeof(path), output_format, i);
+        initOutput(&job->output[i], path);
+    }
+}
+
+void destroyPartitions(MR_Job *job) {
+    for (unsigned int i = 0; i < job->numSlots; i++) {
+        releasePartition(job->bucket[i]); // every record, key and value of the slot
+        free(job->bucket[i]);
+    }
+    for (unsigned int i = 0; i < job->numParts; i++) {
+        closeOutput(&job->output[i]);
+    }
+    free(job->bucket);
+    free(job->slotPartition);
+    free(job->reducing);
+    free(job->output);
+    free(job->stats);
+}
+
+/**
+* Print the size of every partition and how far the largest one is above the mean
+* Parameters:
+*     stream        - Where to print
+*     stats         - Stats of each partition, see MR_Options.partition_stats
+*     num_parts     - Number of partitions
+*/
+void MR_PrintPartitionStats(FILE *stream, const MR_PartitionStats *stats, unsigned int num_parts){
+    size_t total = 0, largest = 0;
+    fprintf(stream, "partition %12s %14s %14s %6s\n", "records", "bytes", "spilled", "slots");
+    for(unsigned int i = 0; i < num_parts; i++){
+        fprintf(stream, "%9u %12zu %14zu %14zu %6u\n", i, stats[i].records, stats[i].bytes, stats[i].spillBytes, stats[i].slots);
+        total += stats[i].bytes;
+        if(stats[i].bytes > largest){
+            largest = stats[i].bytes;
+        }
+    }
+    if(total > 0){
+        fprintf(stream, "largest partition is %.2fx the mean\n", (double)largest * num_parts / total);
+    }
+}
+
+typedef struct MR_Options {
+    Combiner combiner;                      // Run on each map task's output, NULL to skip combining
+    unsigned int num_workers;               // Number of threads in the thread pool
+    unsigned int num_parts;                 // Number of partitions to be created
+    ThreadPool_kind_t scheduler;            // THREADPOOL_SJF or THREADPOOL_WORK_STEALING
+    ThreadPool_affinity_t affinity;         // Pin workers to CPUs, compact or spread over NUMA nodes
+    size_t split_size;                      // MR_RunSplits only: target bytes per map task, 0 for one task per file
+    const char *output_format;              // printf format of a partition's output file, given the partition index
+    size_t memory_budget;                   // Bytes a partition may hold in memory before spilling to disk, 0 for no limit
+    const char *spill_dir;                  // Directory for spill files, NULL for $TMPDIR or /tmp
+    const char *cache_dir;                  // Directory caching each split's combined map output across runs, NULL to always map
+    const char *cache_tag;                  // Required with cache_dir: names the mapper, combiner and their version, entries of other tags are ignored
+    bool pipeline;                          // Skip the map/reduce barrier and merge runs while mappers are still running
+    bool rebalance;                         // Hash keys to MR_REBALANCE_SLOTS slots per partition and even out the partitions' bytes
+    MR_PartitionStats *partition_stats;     // Array of num_parts entries filled in at the end of the job, NULL to skip
+    void *job_state;                        // Returned by MR_JobState in the job's combiner and reducer, e.g. an MR_TopK
+} MR_Options;
+
+/**
+* Options matching MR_Run: no combiner and a shortest job first pool
+* Parameters:
+*     num_workers  - Number of threads in the thread pool
+*     num_parts    - Number of partitions to be created
+* Return:
+*     MR_Options   - Options to tweak and pass to MR_RunWithOptions
+*/
+MR_Options MR_DefaultOptions(unsigned int num_workers, unsigned int num_parts){
+    MR_Options options;
+    options.combiner = NULL;
+    options.num_workers = num_workers;
+    options.num_parts = num_parts;
+    options.scheduler = THREADPOOL_SJF;
+    options.affinity = THREADPOOL_AFFINITY_NONE;
+    options.split_size = MR_DEFAULT_SPLIT_SIZE;
+    options.output_format = MR_DEFAULT_OUTPUT_FORMAT;
+    options.memory_budget = 0;
+    options.spill_dir = NULL;
+    options.cache_dir = NULL;
+    options.cache_tag = NULL;
+    options.pipeline = false;
+    options.rebalance = false;
+    options.partition_stats = NULL;
+    options.job_state = NULL;
+    return options;
+}
+
+/**
+* State the job was given through MR_Options.job_state, so a combiner or
+* reducer shared by several jobs can tell them apart
+* Return:
+*     void*        - job_state of the job the calling task belongs to, NULL outside a task
+*/
+void *MR_JobState(void){
+    return (threadJob != NULL) ? threadJob->state : NULL;
+}
+
+void MR_Reduce(void *threadarg);
+void MR_MapTask(void *split);
+
+typedef struct SlotLoad {
+    size_t bytes;
+    unsigned int slot;
+} SlotLoad;
+
+int compareSlotLoads(const void *a, const void *b){
+    const SlotLoad *x = (const SlotLoad *)a, *y = (const SlotLoad *)b;
+    if(x->bytes != y->bytes){
+        return x->bytes > y->bytes ? -1 : 1;
+    }
+    return x->slot < y->slot ? -1 : (x->slot > y->slot);
+}
+
+/**
+* Spread the hash slots over the partitions so their bytes come out even:
+* largest slot first, each to the partition with the fewest bytes so far.
+* A hot partition's slots end up reduced by several workers in parallel;
+* only a single hot key still lands in one partition
+* Parameters:
+*     job           - Job whose map phase just ended
+*/
+void rebalancePartitions(MR_Job *job){
+    unsigned int numSlots = job->numSlots, numParts = job->numParts;
+    SlotLoad *loads = (SlotLoad *)malloc(sizeof(SlotLoad) * numSlots);
+    size_t *assigned = (size_t *)calloc(numParts, sizeof(size_t));
+    for(unsigned int i = 0; i < numSlots; i++){
+        loads[i].bytes = job->bucket[i]->memoryBytes + job->bucket[i]->spillBytes;
+        loads[i].slot = i;
+    }
+    qsort(loads, numSlots, sizeof(SlotLoad), compareSlotLoads);
+    for(unsigned int i = 0; i < numSlots && loads[i].bytes > 0; i++){
+        unsigned int lightest = 0;
+        for(unsigned int p = 1; p < numParts; p++){
+            if(assigned[p] < assigned[lightest]){
+                lightest = p;
+            }
+        }
+        job->slotPartition[loads[i].slot] = lightest;
+        assigned[lightest] += loads[i].bytes;
+    }
+    free(assigned);
+    free(loads);
+}
+
+/**
+* Seal the partitions and queue a reduce job for every non-empty one, sized
+* by the bytes its slots hold in memory and on disk so the smallest
+* partitions run first. Must only be called once every map task has finished
+* Parameters:
+*     job           - Job whose map phase just ended
+*/
+void MR_SubmitReducers(MR_Job *job){
+    unsigned int num_parts = job->numParts;
+    if(job->numSlots > num_parts){
+        rebalancePartitions(job);
+    }
+    for(unsigned int i = 0; i < job->numSlots; i++){ // map tasks are done, the slots are stable
+        Bucket *bucket = job->bucket[i];
+        MR_PartitionStats *stats = &job->stats[job->slotPartition[i]];
+        stats->records += bucket->size;
+        stats->bytes += bucket->memoryBytes + bucket->spillBytes;
+        stats->spillBytes += bucket->spillBytes;
+        stats->slots++;
+    }
+    void **reduceArgs = (void **)malloc(sizeof(void *) * num_parts);
+    size_t *reduceSizes = (size_t *)malloc(sizeof(size_t) * num_parts);
+    unsigned int reduceCount = 0;
+    for(unsigned int i = 0; i < num_parts; i++){
+        if(job->stats[i].records ==0){
+            continue;
+        }
+        ThreadArgs *threadarg = malloc(sizeof(ThreadArgs));
+        threadarg->partId = i;
+        threadarg->reducer = job->reducer;
+        threadarg->size = job->stats[i].bytes;
+        threadarg->job = job;
+        reduceArgs[reduceCount] = threadarg;
+        reduceSizes[reduceCount++] = threadarg->size;
+    }
+    ThreadPool_latch_add(&job->reduced, reduceCount);
+    ThreadPool_add_jobs(job->pool, (thread_func_t)MR_Reduce, reduceArgs, reduceSizes, reduceCount, JOB_REDUCE);
+    free(reduceArgs);
+    free(reduceSizes);
+    if(DEBUG){printf("\nSubmit Reducers Jobs");
+        fflush(stdout);}
+    // Drop the seal's count: the job may be freed by MR_Wait from here on, do not touch it
+    ThreadPool_latch_count_down(&job->reduced);
+}
+
+/**
+* Mark a map or compaction job finished. The last one seals the partitions
+* and queues the reducers from its worker, so jobs sharing a pool never wait
+* on each other
+* Parameters:
+*     job           - Job the task belongs to
+*/
+void MR_TaskDone(MR_Job *job){
+    if(ThreadPool_latch_count_down(&job->mapped)){
+        MR_SubmitReducers(job);
+    }
+}
+
+/**
+* Size every input file in one pass so map jobs can be queued shortest first
+* Parameters:
+*     file_count   - Number of files
+*     file_names   - Array of filenames
+*     sizes        - Filled with the size in bytes of each file, 0 if it cannot be stat'd
+*/
+void MR_FileSizes(unsigned int file_count, char *file_names[], size_t *sizes){
+    struct stat fileInfo;
+    for(unsigned int i = 0; i < file_count; i++){
+        sizes[i] = (stat(file_names[i], &fileInfo) == 0) ? (size_t)fileInfo.st_size : 0;
+    }
+}
+/**
+* Find where a split ending near pos should stop so no line is cut in two
+* Parameters:
+*     fd           - Open input file
+*     pos          - Nominal end of the split
+*     fileSize     - Size of the file
+* Return:
+*     off_t        - Offset just past the first newline at or after pos - 1, fileSize if there is none
+*/
+off_t MR_RecordBoundary(int fd, off_t pos, off_t fileSize){
+    char buffer[4096];
+    off_t at = pos - 1;
+    while(at < fileSize){
+        ssize_t got = pread(fd, buffer, sizeof(buffer), at);
+        if(got <= 0){
+            break;
+        }
+        char *newline = memchr(buffer, '\n', got);
+        if(newline != NULL){
+            return at + (newline - buffer) + 1;
+        }
+        at += got;
+    }
+    return fileSize;
+}
+
+/**
+* Carve the input files into newline aligned byte ranges of about split_size bytes
+* Parameters:
+*     file_count   - Number of files
+*     file_names   - Array of filenames
+*     split_size   - Target bytes per split, 0 for one split per file
+*     split_count  - Set to the number of splits returned
+* Return:
+*     MR_Split*    - Array of splits, to be freed by the caller
+*/
+MR_Split *MR_PlanSplits(unsigned int file_count, char *file_names[], size_t split_size, unsigned int *split_count){
+    size_t *sizes = (size_t *)malloc(sizeof(size_t) * file_count);
+    MR_FileSizes(file_count, file_names, sizes);
+    unsigned int capacity = file_count;
+    for(unsigned int i = 0; i < file_count && split_size > 0; i++){
+        capacity += sizes[i] / split_size;
+    }
+    MR_Split *splits = (MR_Split *)malloc(sizeof(MR_Split) * (capacity > 0 ? capacity : 1));
+    unsigned int count = 0;
+    for(unsigned int i = 0; i < file_count; i++){
+        off_t fileSize = sizes[i];
+        int fd = (split_size > 0 && sizes[i] > split_size) ? open(file_names[i], O_RDONLY) : -1;
+        off_t start = 0;
+        do{
+            off_t end = fileSize;
+            if(fd >= 0 && (size_t)(fileSize - start) > split_size){
+                end = MR_RecordBoundary(fd, start + split_size, fileSize);
+            }
+            splits[count].file_name = file_names[i];
+            splits[count].offset = start;
+            splits[count].length = end - start;
+            count++;
+            start = end;
+        } while(start < fileSize);
+        if(fd >= 0){
+            close(fd);
+        }
+    }
+    free(sizes);
+    *split_count = count;
+    return splits;
+}
+
+/**
+* Allocate a job and its empty partitions without queuing anything
+* Parameters:
+*     pool         - Pool the job will run on
+*     mapper       - File name map function, used when splitMapper is NULL
+*     splitMapper  - Byte range map function, NULL to map whole files with mapper
+*     reducer      - Function pointer to the reduce function
+*     options      - Combiner and partition settings
+* Return:
+*     MR_Job*      - Job to pass to MR_SubmitMaps or MR_SubmitReducers, then MR_Wait
+*/
+MR_Job *MR_NewJob(ThreadPool_t *pool, Mapper mapper, SplitMapper splitMapper, Reducer reducer, const MR_Options *options){
+    MR_Job *job = (MR_Job *)malloc(sizeof(MR_Job));
+    initPartitions(job, options->num_parts, options->rebalance ? MR_REBALANCE_SLOTS : 1, options->output_format);
+    job->mapper = mapper;
+    job->splitMapper = splitMapper;
+    job->combiner = options->combiner;
+    job->pool = pool;
+    job->reducer = reducer;
+    job->pipeline = options->pipeline;
+    job->memoryBudget = options->memory_budget;
+    if(options->rebalance && job->memoryBudget > 0){ // the budget is per partition, buckets are per slot
+        job->memoryBudget = (job->memoryBudget + MR_REBALANCE_SLOTS - 1) / MR_REBALANCE_SLOTS;
+    }
+    job->spillDir = options->spill_dir;
+    if(job->spillDir == NULL){
+        job->spillDir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    }
+    job->cacheDir = options->cache_dir;
+    job->cacheTag = options->cache_tag;
+    if(job->cacheDir != NULL && job->cacheTag == NULL){
+        fputs("MR_Options.cache_dir needs a cache_tag naming the job's mapper and combiner\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    if(job->cacheDir != NULL){
+        raiseFileLimit(); // every cached split a partition reads is open while it is reduced
+    }
+    job->statsOut = options->partition_stats;
+    job->state = options->job_state;
+    ThreadPool_latch_init(&job->reduced, 1); // held by the seal until the reducers are queued
+    ThreadPool_latch_init(&job->mapped, 0);
+    job->splits = NULL;
+    job->mapArgs = NULL;
+    return job;
+}
+
+/**
+* Queue a map task for every split of a new job. The last one to finish
+* queues the reducers
+* Parameters:
+*     job          - Job from MR_NewJob
+*     splits       - Input of the map tasks, owned by the job from now on
+*     splitCount   - Number of splits
+*/
+void MR_SubmitMaps(MR_Job *job, MR_Split *splits, unsigned int splitCount){
+    ThreadPool_t *pool = job->pool;
+    job->splits = splits;
+    job->mapArgs = (MapTaskArgs *)malloc(sizeof(MapTaskArgs) * (splitCount > 0 ? splitCount : 1));
+    void **mapArgs = (void **)malloc(sizeof(void *) * (splitCount > 0 ? splitCount : 1));
+    size_t *mapSizes = (size_t *)malloc(sizeof(size_t) * (splitCount > 0 ? splitCount : 1));
+    for(unsigned int i = 0; i < splitCount; i++){
+        job->mapArgs[i].job = job;
+        job->mapArgs[i].split = &job->splits[i];
+        mapArgs[i] = &job->mapArgs[i];
+        mapSizes[i] = job->splits[i].length;
+    }
+    ThreadPool_latch_init(&job->mapped, splitCount);
+    if(splitCount == 0){
+        MR_SubmitReducers(job);
+    }
+    else{
+        ThreadPool_add_jobs(pool, MR_MapTask, mapArgs, mapSizes, splitCount, JOB_MAP);
+    }
+    free(mapArgs);
+    free(mapSizes);
+    if(DEBUG)
+        {
+        printf("\nSubmit Mapper Jobs");
+        fflush(stdout);
+        }
+}
+
+/**
+* Start a MapReduce job on a pool and return without waiting for it. Each job
+* owns its partitions, so several can run on one pool at once
+* Parameters:
+*     pool         - Pool to run the job on, kept by the caller across jobs
+*     file_count   - Number of files
+*     file_names   - Array of filenames, must stay valid until MR_Wait returns
+*     mapper       - File name map function, used when splitMapper is NULL
+*     splitMapper  - Byte range map function, NULL to map whole files with mapper
+*     reducer      - Function pointer to the reduce function
+*     options      - Combiner, partition and split settings. num_workers, scheduler and affinity
+*                    are ignored, the pool is already set up
+* Return:
+*     MR_Job*      - Job to pass to MR_Wait
+*/
+MR_Job *MR_SubmitJob(
+    ThreadPool_t *pool, unsigned int file_count, char *file_names[],
+    Mapper mapper, SplitMapper splitMapper, Reducer reducer, const MR_Options *options){
+        MR_Job *job = MR_NewJob(pool, mapper, splitMapper, reducer, options);
+        unsigned int splitCount;
+        MR_Split *splits = MR_PlanSplits(file_count, file_names, (splitMapper != NULL) ? options->split_size : 0, &splitCount);
+        MR_SubmitMaps(job, splits, splitCount);
+        return job;
+    }
+
+/**
+* Wait for a job started with MR_Submit or MR_SubmitSplits, then free it. Must
+* not be called from a task running on the job's pool
+* Parameters:
+*     job          - Job to wait for
+*/
+void MR_Wait(MR_Job *job){
+    ThreadPool_latch_wait(&job->reduced);
+    if(DEBUG){printf("\nReducer jobs finished\n");
+        MR_PrintPartitionStats(stdout, job->stats, job->numParts);
+        fflush(stdout);}
+    if(job->statsOut != NULL){
+        memcpy(job->statsOut, job->stats, sizeof(MR_PartitionStats) * job->numParts);
+    }
+    destroyPartitions(job);
+    free(job->splits);
+    free(job->mapArgs);
+    free(job);
+}
+
+/**
+* Start a MapReduce job on a caller supplied pool, see MR_SubmitJob
+* Parameters:
+*     pool         - Pool to run the job on
+*     file_count   - Number of files
+*     file_names   - Array of filenames, must stay valid until MR_Wait returns
+*     mapper       - Function pointer to the map function
+*     reducer      - Function pointer to the reduce function
+*     options      - Combiner and partition settings, see MR_DefaultOptions
+* Return:
+*     MR_Job*      - Job to pass to MR_Wait
+*/
+MR_Job *MR_Submit(
+    ThreadPool_t *pool, unsigned int file_count, char *file_names[],
+    Mapper mapper, Reducer reducer, const MR_Options *options){
+        return MR_SubmitJob(pool, file_count, file_names, mapper, NULL, reducer, options);
+    }
+
+/**
+* Start a MapReduce job over newline aligned byte ranges on a caller supplied
+* pool, see MR_SubmitJob
+* Parameters:
+*     pool         - Pool to run the job on
+*     file_count   - Number of files
+*     file_names   - Array of filenames, must stay valid until MR_Wait returns
+*     mapper       - Function pointer to the split map function
+*     reducer      - Function pointer to the reduce function
+*     options      - Combiner, partition and split settings, see MR_DefaultOptions
+* Return:
+*     MR_Job*      - Job to pass to MR_Wait
+*/
+MR_Job *MR_SubmitSplits(
+    ThreadPool_t *pool, unsigned int file_count, char *file_names[],
+    SplitMapper mapper, Reducer reducer, const MR_Options *options){
+        return MR_SubmitJob(pool, file_count, file_names, NULL, mapper, reducer, options);
+    }
+
+/**
+* Run a MapReduce job with either a file name mapper or a split mapper on a
+* pool of its own. With $MR_TRACE set, a Chrome trace of the pool's jobs
+* and worker counters is written to that path when the job ends
+* Parameters:
+*     file_count   - Number of files
+*     file_names   - Array of filenames
+*     mapper       - File name map function, used when splitMapper is NULL
+*     splitMapper  - Byte range map function, NULL to map whole files with mapper
+*     reducer      - Function pointer to the reduce function
+*     options      - Combiner, pool, partition and split settings
+*/
+void MR_RunJob(
+    unsigned int file_count, char *file_names[],
+    Mapper mapper, SplitMapper splitMapper, Reducer reducer, const MR_Options *options){
+        ThreadPool_t *pool = ThreadPool_create_affinity(options->num_workers, options->scheduler, options->affinity);
+        if(DEBUG){printf("\nCreating Thread Pool");
+            fflush(stdout);
+        }
+        const char *tracePath = getenv("MR_TRACE");
+        if(tracePath != NULL && tracePath[0] != '\0'){
+            ThreadPool_set_tracing(pool, true);
+        }
+        MR_Wait(MR_SubmitJob(pool, file_count, file_names, mapper, splitMapper, reducer, options));
+        if(tracePath != NULL && tracePath[0] != '\0'){
+            ThreadPool_check(pool); // the last job's span is recorded after the job itself returns
+            ThreadPool_write_trace(pool, tracePath);
+        }
+        if(DEBUG){ThreadPool_print_metrics(stdout, pool);
+            fflush(stdout);}
+        ThreadPool_destroy(pool);
+    }
+
+/**
+* Run the MapReduce framework
+* Parameters:
+*     file_count   - Number of files (i.e. input splits)
+*     file_names   - Array of filenames
+*     mapper       - Function pointer to the map function
+*     reducer      - Function pointer to the reduce function
+*     options      - Combiner, pool and partition settings, see MR_DefaultOptions.
+*                    split_size is ignored, a file name mapper always reads whole files
+*/
+void MR_RunWithOptions(
+    unsigned int file_count, char *file_names[],
+    Mapper mapper, Reducer reducer, const MR_Options *options){
+        MR_RunJob(file_count, file_names, mapper, NULL, reducer, options);
+    }
+
+/**
+* Run the MapReduce framework over newline aligned byte ranges of the input
+* files, so large files are mapped by several workers at once
+* Parameters:
+*     file_count   - Number of files
+*     file_names   - Array of filenames
+*     mapper       - Function pointer to the split map function
+*     reducer      - Function pointer to the reduce function
+*     options      - Combiner, pool, partition and split settings, see MR_DefaultOptions
+*/
+void MR_RunSplits(
+    unsigned int file_count, char *file_names[],
+    SplitMapper mapper, Reducer reducer, const MR_Options *options){
+        MR_RunJob(file_count, file_names, NULL, mapper, reducer, options);
+    }
+
+/**
+* Run the MapReduce framework with a combiner applied to every map task's output
+* Parameters:
+*     file_count   - Number of files (i.e. input splits)
+*     file_names   - Array of filenames
+*     mapper       - Function pointer to the map function
+*     combiner     - Function pointer to the combine function, NULL to skip combining
+*     reducer      - Function pointer to the reduce function
+*     num_workers  - Number of threads in the thread pool
+*     num_parts    - Number of partitions to be created
+*/
+void MR_RunWithCombiner(
+    unsigned int file_count, char *file_names[],
+    Mapper mapper, Combiner combiner, Reducer reducer,
+    unsigned int num_workers, unsigned int num_parts){
+        MR_Options options = MR_DefaultOptions(num_workers, num_parts);
+        options.combiner = combiner;
+        MR_RunWithOptions(file_count, file_names, mapper, reducer, &options);
+    }
+
+/**
+* Run the MapReduce framework
+* Parameters:
+*     file_count   - Number of files (i.e. input splits)
+*     file_names   - Array of filenames
+*     mapper       - Function pointer to the map function
+*     reducer      - Function pointer to the reduce function
+*     num_workers  - Number of threads in the thread pool
+*     num_parts    - Number of partitions to be created
+*/
+void MR_Run(
+    unsigned int file_count, char *file_names[],
+    Mapper mapper, Reducer reducer,
+    unsigned int num_workers, unsigned int num_parts){
+        MR_RunWithCombiner(file_count, file_names, mapper, NULL, reducer, num_workers, num_parts);
+    }
+
+unsigned int MR_Partitioner(char *key, unsigned int num_partitions); // Protype Partitioner function
+
+/**
+* 64-bit hash of a key (hash.h), shared by the partitioner, the emit buffers
+* and the stored keys' headers
+* Parameters:
+*     key           - Key bytes, need not be NUL terminated
+*     length        - Number of bytes in the key
+* Return:
+*     unsigned long - Hash of the key
+*/
+unsigned long MR_HashBytes(const char *key, size_t length){
+    return hashBytes(key, length, 0);
+}
+
+unsigned long MR_Hash(char *key){
+    return MR_HashBytes(key, strlen(key));
+}
+
+void initEmitBuffer(EmitBuffer *buffer, size_t capacity){
+    buffer->slots = (EmitEntry *)calloc(capacity, sizeof(EmitEntry));
+    buffer->capacity = capacity;
+    buffer->used = 0;
+    initArena(&buffer->arena, ThreadPool_current_node()); // the map task's worker fills it
+}
+
+void destroyEmitBuffer(EmitBuffer *buffer){
+    free(buffer->slots);
+    buffer->slots = NULL;
+    buffer->capacity = 0;
+    buffer->used = 0;
+    destroyArena(&buffer->arena);
+}
+
+/**
+* Find the slot holding key, or the free slot where it should be inserted
+* Parameters:
+*     buffer        - Emit buffer to probe
+*     key           - Key being looked up
+*     length        - Bytes in the key
+*     hash          - MR_HashBytes(key, length)
+* Return:
+*     EmitEntry*    - Matching or free slot
+*/
+EmitEntry *emitBufferProbe(EmitBuffer *buffer, const char *key, size_t length, unsigned long hash){
+    size_t mask = buffer->capacity - 1;
+    size_t i = hash & mask;
+    while(buffer->slots[i].key != NULL){
+        EmitEntry *slot = &buffer->slots[i];
+        if(slot->hash == hash && slot->keyLength == length && memcmp(slot->key, key, length) == 0){
+            return &buffer->slots[i];
+        }
+        i = (i + 1) & mask; // linear probing
+    }
+    return &buffer->slots[i];
+}
+
+/**
+* Double the capacity of an emit buffer and re-insert every entry
+* Parameters:
+*     buffer        - Emit buffer to grow
+*/
+void growEmitBuffer(EmitBuffer *buffer){
+    EmitEntry *old = buffer->slots;
+    size_t oldCapacity = buffer->capacity;
+    buffer->slots = (EmitEntry *)calloc(oldCapacity * 2, sizeof(EmitEntry));
+    buffer->capacity = oldCapacity * 2;
+    buffer->used = 0;
+    for(size_t i = 0; i < oldCapacity; i++){
+        if(old[i].key == NULL){
+            continue;
+        }
+        *emitBufferProbe(buffer, old[i].key, old[i].keyLength, old[i].hash) = old[i];
+        buffer->used++;
+    }
+    free(old);
+}
+
+/**
+* Group a new pair with the other values emitted for its key by this thread.
+* The key is copied into the buffer's arena once and shared by all its values
+* Parameters:
+*     buffer        - Emit buffer of the calling thread
+*     key           - Key of the pair
+*     keyLength     - Bytes in the key
+*     value         - Value of the pair
+*     valueLength   - Bytes in the value
+*/
+void emitBufferInsert(EmitBuffer *buffer, const char *key, size_t keyLength, const char *value, size_t valueLength){
+    if((buffer->used + 1) * 2 > buffer->capacity){ // keep load factor under 1/2
+        growEmitBuffer(buffer);
+    }
+    unsigned long hash = MR_HashBytes(key, keyLength);
+    EmitEntry *entry = emitBufferProbe(buffer, key, keyLength, hash);
+    KeyValue *node = (KeyValue *)arenaAlloc(&buffer->arena, sizeof(KeyValue));
+    char *text = (char *)arenaAlloc(&buffer->arena, MR_VALUE_SPACE(valueLength));
+    node->value = storeValue(&text, value, valueLength);
+    node->next = NULL;
+    if(entry->key == NULL){ // first value for this key, stored with its header so combiners can use MR_KeyLength
+        text = (char *)arenaAlloc(&buffer->arena, MR_KEY_SPACE(keyLength));
+        entry->key = storeKey(&text, key, keyLength, hash);
+        entry->keyLength = keyLength;
+        entry->hash = hash;
+        entry->head = node;
+        entry->count = 0;
+        entry->valueBytes = 0;
+        buffer->used++;
+    }
+    else{
+        entry->tail->next = node;
+    }
+    node->key = entry->key;
+    entry->tail = node;
+    entry->count++;
+    entry->valueBytes += MR_VALUE_SPACE(valueLength);
+}
+
+/**
+* Replace the values buffered for a key with the pairs the combiner emits for them
+* Parameters:
+*     job           - Job running the map task
+*     buffer        - Emit buffer holding the entry
+*     entry         - Emit buffer entry to combine
+*/
+void combineEntry(MR_Job *job, EmitBuffer *buffer, EmitEntry *entry){
+    CombineState state = {entry->key, entry->keyLength, &buffer->arena, entry->head, entry->head, NULL, NULL, 0, 0};
+    entry->tail->next = NULL;
+    threadCombineState = &state;
+    job->combiner(entry->key, entry->hash % job->numParts);
+    threadCombineState = NULL;
+
+    entry->head = state.head;
+    entry->tail = state.tail;
+    entry->count = state.count;
+    entry->valueBytes = state.valueBytes;
+}
+
+/**
+* Compare two stored keys: a shared copy, then the cached hashes and lengths,
+* and only then the bytes
+*/
+bool MR_SameKey(const char *a, const char *b){
+    if(a == b){
+        return true;
+    }
+    const KeyHeader *left = MR_KEY_HEADER(a), *right = MR_KEY_HEADER(b);
+    return left->hash == right->hash && left->length == right->length && memcmp(a, b, left->length) == 0;
+}
+
+bool runCursorBefore(const RunCursor *a, const RunCursor *b){
+    const char *left = a->next->key, *right = b->next->key;
+    if(left == right){
+        return false;
+    }
+    size_t leftLength = MR_KEY_HEADER(left)->length, rightLength = MR_KEY_HEADER(right)->length;
+    int order = memcmp(left, right, leftLength < rightLength ? leftLength : rightLength);
+    return order < 0 || (order == 0 && leftLength < rightLength);
+}
+
+void mergeSiftDown(Merge *merge, unsigned int i){
+    RunCursor *heap = merge->heap;
+    RunCursor cursor = heap[i];
+    while(1){
+        unsigned int child = 2 * i + 1;
+        if(child >= merge->count){
+            break;
+        }
+        if(child + 1 < merge->count && runCursorBefore(&heap[child + 1], &heap[child])){
+            child++;
+        }
+        if(!runCursorBefore(&heap[child], &cursor)){
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = cursor;
+}
+
+/**
+* A spilled or cached run ended inside a key group or holds garbage. Going on
+* would reduce partial values without any error, so the job is stopped
+*/
+void spillCorrupt(void){
+    fputs("MapReduce: spill or cache file is truncated or corrupt\n", stderr);
+    exit(EXIT_FAILURE);
+}
+
+/**
+* Decode the next key group of a spill file into the cursor's spare group
+* buffer. The group handed out before stays valid, so values of the key being
+* reduced survive the cursor moving on to the next key. A run that ends
+* inside a group, or cannot be read, ends the process through spillCorrupt
+* Parameters:
+*     cursor        - Cursor of a spilled run
+* Return:
+*     true          - If a group was read
+*     false         - At the end of the run
+*/
+bool spillCursorNext(RunCursor *cursor){
+    SpillCursor *spill = cursor->spill;
+    uint64_t keyLength, count, valueBytes;
+    if(spillRemaining(&spill->input) == 0){
+        return false;
+    }
+    if(!spillReadVarint(&spill->input, &keyLength) || !spillReadVarint(&spill->input, &count) ||
+       !spillReadVarint(&spill->input, &valueBytes) || count == 0 || valueBytes < 2 * count ||
+       keyLength + valueBytes > spillRemaining(&spill->input)){ // every value takes a length byte and a NUL
+        spillCorrupt();
+    }
+    spill->current ^= 1;
+    size_t need = count * sizeof(KeyValue) + MR_KEY_SPACE(keyLength) + valueBytes;
+    if(need > spill->capacity[spill->current]){
+        free(spill->groups[spill->current]);
+        spill->groups[spill->current] = (char *)malloc(need);
+        spill->capacity[spill->current] = need;
+        if(spill->groups[spill->current] == NULL){
+            perror("spill group");
+            exit(EXIT_FAILURE);
+        }
+    }
+    KeyValue *records = (KeyValue *)spill->groups[spill->current];
+    char *text = (char *)(records + count);
+    KeyHeader *header = (KeyHeader *)text; // records keep text aligned
+    char *key = (char *)(header + 1);
+    char *value = key + keyLength + 1;
+    if(!spillRead(&spill->input, key, keyLength) || !spillRead(&spill->input, value, valueBytes)){
+        spillCorrupt();
+    }
+    key[keyLength] = '\0';
+    header->hash = MR_HashBytes(key, keyLength);
+    header->length = keyLength;
+    const char *valuesEnd = value + valueBytes;
+    for(uint64_t i = 0; i < count; i++){
+        size_t headerLength = ((unsigned char)*value == MR_VALUE_LONG) ? 2 + sizeof(uint32_t) : 1;
+        if(valuesEnd - value < (ptrdiff_t)headerLength + 1){
+            spillCorrupt();
+        }
+        value += headerLength; // skip the length
+        size_t length = MR_ValueLength(value);
+        if((size_t)(valuesEnd - value) < length + 1 || value[length] != '\0'){
+            spillCorrupt();
+        }
+        records[i].key = key;
+        records[i].value = value;
+        records[i].next = (i + 1 < count) ? &records[i + 1] : NULL;
+        value += length + 1;
+    }
+    if(value != valuesEnd){
+        spillCorrupt();
+    }
+    cursor->next = records;
+    cursor->end = records + count;
+    return true;
+}
+
+/**
+* Set up a k-way merge over sorted runs held in memory and spilled to disk
+* Parameters:
+*     merge         - Merge to initialise
+*     runs          - In memory runs
+*     spills        - Spilled runs
+*/
+void mergeInit(Merge *merge, Run *runs, Spill *spills){
+    unsigned int count = 0;
+    for(Run *run = runs; run != NULL; run = run->next){
+        count++;
+    }
+    for(Spill *spill = spills; spill != NULL; spill = spill->next){
+        count++;
+    }
+    merge->heap = (RunCursor *)malloc(sizeof(RunCursor) * (count + 1));
+    merge->count = 0;
+    for(Run *run = runs; run != NULL; run = run->next){
+        RunCursor *cursor = &merge->heap[merge->count++];
+        cursor->next = run->records;
+        cursor->end = run->records + run->count;
+        cursor->spill = NULL;
+    }
+    for(Spill *spill = spills; spill != NULL; spill = spill->next){
+        if(spill->fd < 0 && (spill->fd = open(spill->path, O_RDONLY | O_CLOEXEC)) < 0){
+            perror(spill->path); // its records would be missing from the output
+            exit(EXIT_FAILURE);
+        }
+        RunCursor *cursor = &merge->heap[merge->count];
+        cursor->spill = (SpillCursor *)calloc(1, sizeof(SpillCursor));
+        initSpillInput(&cursor->spill->input, spill->fd, spill->offset, spill->length);
+        if(spillCursorNext(cursor)){
+            merge->count++;
+        }
+        else{
+            destroySpillInput(&cursor->spill->input);
+            free(cursor->spill);
+        }
+    }
+    merge->total = merge->count;
+    for(unsigned int i = merge->count / 2; i-- > 0;){
+        mergeSiftDown(merge, i);
+    }
+}
 
-// library functions that must be implemented
-typedef struct KeyValue {
-    char *key;
-    char *value;
-    struct KeyValue *next;                      // Linked List 
-} KeyValue;
+/**
+* Consume the smallest record of the merge. The heap only needs fixing when
+* its run moves on to another key, values of one key in a run are adjacent
+* Parameters:
+*     merge         - Merge with count > 0
+*/
+void mergeAdvance(Merge *merge){
+    RunCursor *top = &merge->heap[0];
+    char *key = top->next->key;
+    top->next++;
+    if(top->next == top->end && (top->spill == NULL || !spillCursorNext(top))){
+        RunCursor finished = *top; // parked past the heap, a spill's last group may still be in use
+        merge->count--;
+        *top = merge->heap[merge->count];
+        merge->heap[merge->count] = finished;
+        mergeSiftDown(merge, 0);
+    }
+    else if(top->next->key != key){
+        mergeSiftDown(merge, 0);
+    }
+}
 
-typedef struct Bucket{
-    KeyValue *head;                         // Array of Keyvalue partitions 
-    pthread_mutex_t partitionMutex;
-    size_t size;
-} Bucket;
+void mergeDestroy(Merge *merge){
+    for(unsigned int i = 0; i < merge->total; i++){
+        SpillCursor *spill = merge->heap[i].spill;
+        if(spill != NULL){
+            destroySpillInput(&spill->input);
+            free(spill->groups[0]);
+            free(spill->groups[1]);
+            free(spill);
+        }
+    }
+    free(merge->heap);
+    merge->heap = NULL;
+    merge->count = 0;
+    merge->total = 0;
+}
 
-typedef struct Partitions{
-    Bucket ** bucket;
-    unsigned int numParts;
+void pushRuns(Bucket *bucket, Run *first, Run *last){
+    last->next = __atomic_load_n(&bucket->runs, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&bucket->runs, &last->next, first, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+    }
+}
 
-} Partitions;
+/**
+* Merge sorted runs into spill file key groups, each key written once per group
+* Parameters:
+*     output        - Spill or cache file being written
+*     runs          - Runs to merge
+* Return:
+*     size_t        - Bytes written
+*/
+size_t writeSpillGroups(Output *output, Run *runs){
+    size_t written = 0;
+    Merge merge;
+    mergeInit(&merge, runs, NULL);
+    while(merge.count > 0){
+        char *key = merge.heap[0].next->key;
+        uint64_t count = 0, valueBytes = 0;
+        // Values of a key are adjacent within each run but not across runs: size the group first
+        for(unsigned int i = 0; i < merge.count; i++){
+            for(KeyValue *record = merge.heap[i].next; record < merge.heap[i].end && MR_SameKey(record->key, key); record++){
+                count++;
+                valueBytes += MR_VALUE_SPACE(MR_ValueLength(record->value));
+            }
+        }
+        size_t keyLength = MR_KEY_HEADER(key)->length;
+        char header[30];
+        size_t headerLength = varintEncode(header, keyLength);
+        headerLength += varintEncode(header + headerLength, count);
+        headerLength += varintEncode(header + headerLength, valueBytes);
+        outputWrite(output, header, headerLength);
+        outputWrite(output, key, keyLength);
+        while(merge.count > 0 && MR_SameKey(merge.heap[0].next->key, key)){
+            const char *value = merge.heap[0].next->value;
+            size_t length = MR_ValueLength(value);
+            outputWrite(output, value - MR_VALUE_HEADER(length), MR_VALUE_SPACE(length));
+            mergeAdvance(&merge);
+        }
+        written += headerLength + keyLength + valueBytes;
+    }
+    mergeDestroy(&merge);
+    return written;
+}
 
-Partitions partitions;
+/**
+* Merge sorted runs into a spill file
+* Parameters:
+*     runs          - Runs to merge
+*     fd            - Empty spill file
+* Return:
+*     size_t        - Bytes written, 0 if a write failed
+*/
+size_t writeSpill(Run *runs, int fd){
+    Output output;
+    initOutputFd(&output, fd, "spill");
+    size_t written = writeSpillGroups(&output, runs);
+    return detachOutput(&output) ? written : 0;
+}
 
-void initPartitions(unsigned int num_parts){
-    partitions.numParts = num_parts;
-    partitions.bucket = (Bucket **)malloc(num_parts * sizeof(Bucket *));
-    for(unsigned int i =0; i < num_parts; i++){
-        partitions.bucket[i] = (Bucket *)malloc(num_parts * sizeof(Bucket ));
-        partitions.bucket[i]->head = NULL; // sets bucket/partition to empty
-        pthread_mutex_init(&partitions.bucket[i]->partitionMutex, NULL); 
-        partitions.bucket[i]->size = 0;
+/**
+* Add a run stored on disk to a partition, without a lock
+* Parameters:
+*     bucket        - Destination partition
+*     fd            - Open file holding the run, or -1 to open path when the partition is reduced
+*     path          - Cache file holding the run, owned by the partition from now on. NULL for a temporary file
+*     offset        - File offset of the run
+*     length        - Bytes in the run
+*/
+void addSpill(Bucket *bucket, int fd, char *path, off_t offset, size_t length){
+    Spill *spill = (Spill *)malloc(sizeof(Spill));
+    spill->fd = fd;
+    spill->path = path;
+    spill->offset = offset;
+    spill->length = length;
+    spill->next = __atomic_load_n(&bucket->spills, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&bucket->spills, &spill->next, spill, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
     }
+    __atomic_add_fetch(&bucket->spillBytes, length, __ATOMIC_RELAXED);
 }
 
-void destroyPartitions() {
-    for (unsigned int i = 0; i < partitions.numParts; i++) {
-        KeyValue *current = partitions.bucket[i]->head;
-        while (current != NULL) {
-            KeyValue *temp = current;
-            current = current->next;
-            free(temp->key);
-            free(temp->value);
-            // Free the KeyValue node itself
-            free(temp);
+/**
+* Merge sorted runs into one new run held in memory, each key stored once
+* Parameters:
+*     runs          - Runs to merge, left untouched
+* Return:
+*     Run*          - Merged run
+*/
+Run *mergeRunsInMemory(Run *runs){
+    size_t count = 0, bytes = 0;
+    for(Run *run = runs; run != NULL; run = run->next){
+        count += run->count;
+        bytes += run->bytes - sizeof(Run) - run->count * sizeof(KeyValue); // keys take at most their MR_KEY_SPACE, as in the runs
+    }
+    Run *merged = allocRun(count, bytes);
+    KeyValue *record = merged->records;
+    char *text = (char *)(record + count);
+    Merge merge;
+    mergeInit(&merge, runs, NULL);
+    while(merge.count > 0){
+        char *source = merge.heap[0].next->key;
+        char *key = storeKey(&text, source, MR_KEY_HEADER(source)->length, MR_KEY_HEADER(source)->hash);
+        while(merge.count > 0 && MR_SameKey(merge.heap[0].next->key, source)){
+            const char *value = merge.heap[0].next->value;
+            record->key = key;
+            record->value = storeValue(&text, value, MR_ValueLength(value));
+            record->next = record + 1;
+            record++;
+            mergeAdvance(&merge);
         }
-        
-        pthread_mutex_destroy(&partitions.bucket[i]->partitionMutex);
-        free(partitions.bucket[i]);
     }
-    free(partitions.bucket);
+    mergeDestroy(&merge);
+    merged->records[count - 1].next = NULL;
+    return merged;
 }
 
-void MR_Reduce(void *threadarg);
 /**
-* Run the MapReduce framework
+* Merge the runs a partition holds in memory, either into a spill file when
+* the partition is over its memory budget, or into one larger in-memory run
+* so the reducer has fewer runs to merge. An in-memory compaction leaves out
+* a run larger than all the others together, usually the previous
+* compaction's output, so data is not copied over and over. If a spill file
+* cannot be written the runs stay in memory and spilling is turned off
 * Parameters:
-*     file_count   - Number of files (i.e. input splits)
-*     file_names   - Array of filenames
-*     mapper       - Function pointer to the map function
-*     reducer      - Function pointer to the reduce function
-*     num_workers  - Number of threads in the thread pool
-*     num_parts    - Number of partitions to be created
+*     bucket        - Partition to compact
+*     toDisk        - Spill the runs instead of merging them in memory
 */
-void MR_Run(
-    unsigned int file_count, char *file_names[],
-    Mapper mapper, Reducer reducer, 
-    unsigned int num_workers, unsigned int num_parts){
-        ThreadPool_t *pool = ThreadPool_create(num_workers);
-        if(DEBUG){printf("\nCreating Thread Pool");
-            fflush(stdout);
+void compactPartition(Bucket *bucket, bool toDisk){
+    MR_Job *job = bucket->job;
+    if(__atomic_exchange_n(&bucket->merging, 1, __ATOMIC_ACQUIRE)){
+        return; // another task is already merging this partition
+    }
+    Run *runs = __atomic_exchange_n(&bucket->runs, NULL, __ATOMIC_ACQUIRE);
+    Run *largest = NULL;
+    size_t bytes = 0;
+    unsigned int count = 0;
+    for(Run *run = runs; run != NULL; run = run->next){
+        bytes += run->bytes;
+        count++;
+        if(largest == NULL || run->bytes > largest->bytes){
+            largest = run;
         }
-        initPartitions(num_parts);
-        for(int i = 0; i < file_count; i ++){
-            ThreadPool_add_job(pool,(thread_func_t)mapper, file_names[i]);
-
+    }
+    if(!toDisk && largest != NULL && largest->bytes > bytes - largest->bytes){
+        Run **link = &runs; // unlink the large run and put it back untouched
+        while(*link != largest){
+            link = &(*link)->next;
         }
-        if(DEBUG)
-            {
-            printf("\nSubmit Mapper Jobs");
-            fflush(stdout);
+        *link = largest->next;
+        pushRuns(bucket, largest, largest);
+        bytes -= largest->bytes;
+        count--;
+    }
+    Run *last = runs;
+    while(last != NULL && last->next != NULL){
+        last = last->next;
+    }
+    if(count < (toDisk ? 1 : 2)){
+        if(runs != NULL){
+            pushRuns(bucket, runs, last);
+        }
+    }
+    else if(!toDisk){
+        Run *merged = mergeRunsInMemory(runs);
+        size_t mergedBytes = merged->bytes;
+        freeRuns(runs);
+        pushRuns(bucket, merged, merged);
+        __atomic_add_fetch(&bucket->memoryBytes, mergedBytes, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&bucket->memoryBytes, bytes, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&bucket->runCount, count - 1, __ATOMIC_RELAXED);
+    }
+    else{
+        int fd = spillCreate(job->spillDir);
+        size_t written = (fd >= 0) ? writeSpill(runs, fd) : 0;
+        if(written > 0){
+            freeRuns(runs);
+            __atomic_sub_fetch(&bucket->memoryBytes, bytes, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&bucket->runCount, count, __ATOMIC_RELAXED);
+            addSpill(bucket, fd, NULL, 0, written);
+        }
+        else{ // put the runs back and keep the job in memory
+            if(fd >= 0){
+                close(fd);
             }
-        ThreadPool_check(pool);
-        if(DEBUG){printf("\nMapper jobs finished");
-            fflush(stdout);}
+            __atomic_store_n(&job->memoryBudget, 0, __ATOMIC_RELAXED);
+            pushRuns(bucket, runs, last);
+        }
+    }
+    __atomic_store_n(&bucket->merging, 0, __ATOMIC_RELEASE);
+}
 
-        for(int i =0; i < num_parts; i ++){
-            pthread_mutex_lock(&partitions.bucket[i]->partitionMutex);
-            if(partitions.bucket[i]->size ==0){
-                pthread_mutex_unlock(&partitions.bucket[i]->partitionMutex);
-                continue;
-            }
-            pthread_mutex_unlock(&partitions.bucket[i]->partitionMutex);
-            ThreadArgs *threadarg = malloc(sizeof(ThreadArgs));
-            threadarg->partId = i;
-            threadarg->reducer = reducer; 
-            threadarg->size = partitions.bucket[i]->size;
-            ThreadPool_add_job(pool, (thread_func_t)MR_Reduce, threadarg);
+/**
+* Pipeline mode job: merge a partition's runs while map tasks are still running
+* Parameters:
+*     bucket        - Partition to compact
+*/
+void MR_CompactTask(void *bucket){
+    __atomic_store_n(&((Bucket *)bucket)->compactQueued, 0, __ATOMIC_RELAXED);
+    compactPartition((Bucket *)bucket, false);
+    MR_TaskDone(((Bucket *)bucket)->job);
+}
+
+/**
+* Pipeline mode: queue a compaction of the partition once it holds
+* MR_COMPACT_RUNS runs, unless one is already queued. Called from a map task,
+* so the job is counted before the task itself finishes
+* Parameters:
+*     bucket        - Partition a run was just published to
+*/
+void scheduleCompaction(Bucket *bucket){
+    MR_Job *job = bucket->job;
+    if(!job->pipeline || __atomic_load_n(&bucket->runCount, __ATOMIC_RELAXED) < MR_COMPACT_RUNS ||
+       __atomic_exchange_n(&bucket->compactQueued, 1, __ATOMIC_RELAXED)){
+        return;
+    }
+    ThreadPool_latch_add(&job->mapped, 1);
+    ThreadPool_add_task(job->pool, MR_CompactTask, bucket, __atomic_load_n(&bucket->memoryBytes, __ATOMIC_RELAXED), JOB_GENERIC);
+}
+
+/**
+* Order emit buffer entries by key, as strcmp orders the NUL terminated copies
+*/
+int compareEmitEntries(const void *a, const void *b){
+    const EmitEntry *left = *(EmitEntry * const *)a;
+    const EmitEntry *right = *(EmitEntry * const *)b;
+    size_t length = (left->keyLength < right->keyLength) ? left->keyLength : right->keyLength;
+    int order = memcmp(left->key, right->key, length);
+    if(order != 0){
+        return order;
+    }
+    return (left->keyLength > right->keyLength) - (left->keyLength < right->keyLength);
+}
+
+/**
+* Add a run to a partition. Lock free so map tasks never wait on each other.
+* Spills the partition's runs to disk once they exceed the memory budget
+* Parameters:
+*     bucket        - Destination partition
+*     run           - Run to publish, owned by the partition from now on
+*/
+void publishRun(Bucket *bucket, Run *run){
+    MR_Job *job = bucket->job;
+    size_t count = run->count, bytes = run->bytes; // once pushed, another task may spill and free the run
+    pushRuns(bucket, run, run);
+    __atomic_add_fetch(&bucket->size, count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bucket->runCount, 1, __ATOMIC_RELAXED);
+    size_t budget = __atomic_load_n(&job->memoryBudget, __ATOMIC_RELAXED);
+    if(__atomic_add_fetch(&bucket->memoryBytes, bytes, __ATOMIC_RELAXED) > budget && budget > 0){
+        compactPartition(bucket, true);
+    }
+}
+
+/**
+* Copy sorted emit buffer entries into one run. Each key is copied once and
+* shared by all of its records
+* Parameters:
+*     entries       - Entries of one partition, sorted by key
+*     entryCount    - Number of entries
+* Return:
+*     Run*          - Run holding every value of the entries
+*/
+Run *buildRun(EmitEntry **entries, size_t entryCount){
+    size_t count = 0, bytes = 0;
+    for(size_t i = 0; i < entryCount; i++){
+        count += entries[i]->count;
+        bytes += MR_KEY_SPACE(entries[i]->keyLength) + entries[i]->valueBytes;
+    }
+    Run *run = allocRun(count, bytes);
+    KeyValue *record = run->records;
+    char *text = (char *)(record + count);
+    for(size_t i = 0; i < entryCount; i++){
+        EmitEntry *entry = entries[i];
+        char *key = storeKey(&text, entry->key, entry->keyLength, entry->hash);
+        KeyValue *node = entry->head;
+        for(size_t v = 0; v < entry->count; v++){
+            record->key = key;
+            record->value = storeValue(&text, node->value, MR_ValueLength(node->value));
+            record->next = record + 1;
+            record++;
+            node = node->next;
         }
+    }
+    run->records[count - 1].next = NULL;
+    return run;
+}
 
-        if(DEBUG){printf("\nSubmit Reducers Jobs");
-            fflush(stdout);}
-        ThreadPool_check(pool);
-        if(DEBUG){printf("\nReducer jobs finished");
-            fflush(stdout);}
+#define MR_CACHE_MAGIC "MRCACHE2"          // Changes whenever the file layout or the key hash does
 
-        ThreadPool_destroy(pool);
-        destroyPartitions();
+// A cache file holds one split's map output, after the combiner, so a later
+// job over an unchanged input loads it instead of running the mapper again.
+// The header is followed by the input's canonical path, the job's cache tag,
+// a CacheSlot per hash slot, then each slot's run as spill file key groups, in
+// slot order
+typedef struct CacheHeader {
+    char magic[8];                          // MR_CACHE_MAGIC
+    uint32_t numSlots;                      // Hash slots of the job that wrote the file
+    uint32_t pathLength;                    // Bytes of the input's path
+    uint32_t tagLength;                     // Bytes of the cache tag
+    uint32_t reserved;                      // Zero
+    int64_t mtimeSeconds;                   // Input file when it was mapped
+    int64_t mtimeNanoseconds;
+    int64_t size;
+    int64_t offset;                         // Split of the input
+    int64_t length;
+} CacheHeader;
+
+typedef struct CacheSlot {
+    uint64_t records;                       // Pairs in the slot's run
+    uint64_t bytes;                         // Bytes of the slot's run, 0 if the split emitted nothing to it
+} CacheSlot;
 
+typedef struct CacheEntry {
+    char path[PATH_MAX];                    // Cache file of the split
+    char source[PATH_MAX];                  // Canonical path of the input file
+    CacheHeader header;                     // Header matching the input as it is now
+    char temporary[PATH_MAX];               // File being written, renamed to path once complete
+    Output output;
+    CacheSlot *slots;                       // NULL unless the map output is being written
+} CacheEntry;
+
+/**
+* Describe the cache file a split's map output belongs in. Files are named
+* after the input's path, the split's offset, the job's slot count and its
+* cache tag, so a changed input overwrites its stale entry and jobs with
+* different tags don't share entries; the header tells whether an entry is
+* current
+* Parameters:
+*     entry         - Filled in
+*     job           - Job mapping the split
+*     split         - Split to map
+* Return:
+*     true          - If the input could be stat'd
+*     false         - Otherwise, the split is mapped without the cache
+*/
+bool cachePrepare(CacheEntry *entry, MR_Job *job, const MR_Split *split){
+    struct stat info;
+    if(realpath(split->file_name, entry->source) == NULL || stat(entry->source, &info) != 0){
+        return false;
     }
+    memset(&entry->header, 0, sizeof(CacheHeader));
+    memcpy(entry->header.magic, MR_CACHE_MAGIC, sizeof(entry->header.magic));
+    entry->header.numSlots = job->numSlots;
+    entry->header.pathLength = strlen(entry->source);
+    entry->header.tagLength = strlen(job->cacheTag);
+    entry->header.mtimeSeconds = info.st_mtim.tv_sec;
+    entry->header.mtimeNanoseconds = info.st_mtim.tv_nsec;
+    entry->header.size = info.st_size;
+    entry->header.offset = split->offset;
+    entry->header.length = split->length;
+    uint64_t name = hashMix(MR_HashBytes(entry->source, entry->header.pathLength) ^ (uint64_t)split->offset,
+        MR_HashBytes(job->cacheTag, entry->header.tagLength) + job->numSlots);
+    snprintf(entry->path, sizeof(entry->path), "%s/mr-cache-%016llx", job->cacheDir, (unsigned long long)name);
+    entry->slots = NULL;
+    return true;
+}
 
-unsigned int MR_Partitioner(char *key, unsigned int num_partitions); // Protype Partitioner function
 /**
-* Write a specifc map output, a <key, value> pair, to a partition
+* Hand the runs of a current cache file to the partitions as spilled runs.
+* They are opened again by path when their partition is reduced
 * Parameters:
-*     key           - Key of the output
-*     value         - Value of the output
+*     entry         - Entry from cachePrepare
+*     job           - Job mapping the split
+* Return:
+*     true          - If the file matched the input and its runs were added
+*     false         - If there is no current cache file
 */
-void MR_Emit(char *key, char *value){
-    KeyValue* node = (KeyValue *)malloc(sizeof(KeyValue));
-    // Allocate memory for the key and value and copy the data
-    node->key = (char *)malloc(strlen(key) + 1);
-    strcpy(node->key, key);  
-    node->value = (char *)malloc(strlen(value) + 1);  
-    strcpy(node->value, value);  
-    node->next= NULL;
-
-    unsigned int partId = MR_Partitioner(key, partitions.numParts);
-    Bucket *bucket = partitions.bucket[partId];
-    
-    // Modify this partition 
-    pthread_mutex_lock(&bucket->partitionMutex);
-    if(bucket->head == NULL){ // first item case  
-        bucket->head = node;
+bool cacheLoad(CacheEntry *entry, MR_Job *job){
+    int fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        return false;
+    }
+    CacheHeader header;
+    size_t namesBytes = entry->header.pathLength + entry->header.tagLength;
+    char *names = (char *)malloc(namesBytes);
+    size_t tableBytes = sizeof(CacheSlot) * job->numSlots;
+    CacheSlot *slots = (CacheSlot *)malloc(tableBytes);
+    off_t base = sizeof(CacheHeader) + namesBytes + tableBytes;
+    uint64_t bytes = 0;
+    struct stat info;
+    if(names == NULL || slots == NULL){
+        perror("cacheLoad");
+        exit(EXIT_FAILURE);
+    }
+    bool current = pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+        memcmp(&header, &entry->header, sizeof(header)) == 0 && // lengths match, so the reads below fit
+        pread(fd, names, namesBytes, sizeof(header)) == (ssize_t)namesBytes &&
+        memcmp(names, entry->source, header.pathLength) == 0 &&
+        memcmp(names + header.pathLength, job->cacheTag, header.tagLength) == 0 &&
+        pread(fd, slots, tableBytes, sizeof(header) + namesBytes) == (ssize_t)tableBytes;
+    for(unsigned int i = 0; current && i < job->numSlots; i++){
+        bytes += slots[i].bytes;
+    }
+    current = current && fstat(fd, &info) == 0 && info.st_size == base + (off_t)bytes; // not cut short
+    close(fd);
+    off_t offset = base;
+    for(unsigned int i = 0; current && i < job->numSlots; i++){
+        if(slots[i].bytes > 0){
+            addSpill(job->bucket[i], -1, strdup(entry->path), offset, slots[i].bytes);
+            __atomic_add_fetch(&job->bucket[i]->size, slots[i].records, __ATOMIC_RELAXED);
+            offset += slots[i].bytes;
+        }
+    }
+    free(names);
+    free(slots);
+    return current;
+}
+
+/**
+* Start writing a split's map output to a temporary file in the cache
+* directory. Caching is skipped for the split if the file cannot be created
+* Parameters:
+*     entry         - Entry from cachePrepare
+*     job           - Job mapping the split
+*/
+void cacheBegin(CacheEntry *entry, MR_Job *job){
+    snprintf(entry->temporary, sizeof(entry->temporary), "%s/.mr-cache-XXXXXX", job->cacheDir);
+    int fd = mkstemp(entry->temporary);
+    if(fd < 0){
+        perror(entry->temporary);
+        return;
+    }
+    initOutputFd(&entry->output, fd, entry->temporary);
+    entry->slots = (CacheSlot *)calloc(job->numSlots, sizeof(CacheSlot));
+    outputWrite(&entry->output, (const char *)&entry->header, sizeof(CacheHeader));
+    outputWrite(&entry->output, entry->source, entry->header.pathLength);
+    outputWrite(&entry->output, job->cacheTag, entry->header.tagLength);
+    outputWrite(&entry->output, (const char *)entry->slots, sizeof(CacheSlot) * job->numSlots); // filled in by cacheCommit
+}
+
+/**
+* Append a slot's run to the cache file being written. Slots must come in order
+* Parameters:
+*     entry         - Entry being written
+*     slot          - Hash slot of the run
+*     run           - Run the split's map task built for the slot
+*/
+void cacheWriteRun(CacheEntry *entry, unsigned int slot, Run *run){
+    entry->slots[slot].records = run->count;
+    entry->slots[slot].bytes = writeSpillGroups(&entry->output, run);
+}
+
+/**
+* Finish the cache file and move it in place of the split's old entry
+* Parameters:
+*     entry         - Entry being written
+*     job           - Job mapping the split
+*/
+void cacheCommit(CacheEntry *entry, MR_Job *job){
+    int fd = entry->output.fd;
+    size_t tableBytes = sizeof(CacheSlot) * job->numSlots;
+    bool ok = detachOutput(&entry->output) &&
+        pwrite(fd, entry->slots, tableBytes, sizeof(CacheHeader) + entry->header.pathLength + entry->header.tagLength) == (ssize_t)tableBytes;
+    ok = close(fd) == 0 && ok;
+    if(!ok || rename(entry->temporary, entry->path) != 0){
+        perror(entry->path);
+        unlink(entry->temporary);
+    }
+    free(entry->slots);
+    entry->slots = NULL;
+}
+
+/**
+* Turn the buffered pairs into one sorted run per hash slot and publish them
+* Parameters:
+*     job           - Job running the map task
+*     buffer        - Emit buffer of the calling thread, left empty
+*     cache         - Cache file the runs are also written to, NULL if none
+*/
+void flushEmitBuffer(MR_Job *job, EmitBuffer *buffer, CacheEntry *cache){
+    unsigned int numSlots = job->numSlots;
+    size_t *starts = (size_t *)calloc(numSlots + 1, sizeof(size_t));
+    EmitEntry **order = (EmitEntry **)malloc(sizeof(EmitEntry *) * (buffer->used + 1));
+
+    for(size_t i = 0; i < buffer->capacity; i++){
+        EmitEntry *entry = &buffer->slots[i];
+        if(entry->key == NULL){
+            continue;
+        }
+        if(job->combiner != NULL){
+            combineEntry(job, buffer, entry);
+            if(entry->count == 0){
+                entry->key = NULL;
+                continue;
+            }
+        }
+        starts[entry->hash % numSlots + 1]++;
+    }
+    for(unsigned int i = 0; i < numSlots; i++){
+        starts[i + 1] += starts[i];
+    }
+    size_t *fill = (size_t *)malloc(sizeof(size_t) * numSlots); // group the entries by slot
+    memcpy(fill, starts, sizeof(size_t) * numSlots);
+    for(size_t i = 0; i < buffer->capacity; i++){
+        if(buffer->slots[i].key != NULL){
+            order[fill[buffer->slots[i].hash % numSlots]++] = &buffer->slots[i];
+        }
     }
-    else{
-        // Insert the node in sorted order
-        KeyValue *current = bucket->head;
-        KeyValue *previous = NULL;
 
-        // Traverse the list to find the correct position for the new node
-        while (current != NULL && strcmp(current->key, node->key) <= 0) {
-            previous = current;
-            current = current->next;
+    for(unsigned int i = 0; i < numSlots; i++){
+        size_t entryCount = starts[i + 1] - starts[i];
+        if(entryCount == 0){
+            continue;
         }
-        // Insert the node at the found position
-        node->next = current;
-        if(previous == NULL){
-            bucket->head = node;
+        qsort(order + starts[i], entryCount, sizeof(EmitEntry *), compareEmitEntries);
+        Run *run = buildRun(order + starts[i], entryCount);
+        if(cache != NULL){
+            cacheWriteRun(cache, i, run);
+        }
+        publishRun(job->bucket[i], run);
+        scheduleCompaction(job->bucket[i]);
+    }
+    for(size_t i = 0; i < starts[numSlots]; i++){
+        order[i]->key = NULL;
+    }
+    buffer->used = 0;
+    free(fill);
+    free(order);
+    free(starts);
+}
+
+/**
+* Job submitted for every input split. Runs the mapper with a thread local
+* emit buffer and flushes the buffer to the partitions once the mapper returns.
+* With a cache directory, a split whose input is unchanged since it was last
+* mapped is loaded from the cache instead, and a fresh map output is saved
+* Parameters:
+*     arg           - MapTaskArgs of the split
+*/
+void MR_MapTask(void *arg){
+    MapTaskArgs *task = (MapTaskArgs *)arg;
+    MR_Job *job = task->job;
+    CacheEntry cache;
+    bool caching = job->cacheDir != NULL && cachePrepare(&cache, job, task->split);
+    if(caching && cacheLoad(&cache, job)){
+        if(DEBUG){printf("\nCache hit for %s at %lld", task->split->file_name, (long long)task->split->offset);}
+        MR_TaskDone(job);
+        return;
+    }
+    if(caching){
+        cacheBegin(&cache, job);
+    }
+    MR_Job *outerJob = threadJob;
+    EmitBuffer buffer;
+    initEmitBuffer(&buffer, EMIT_BUFFER_INITIAL_CAPACITY);
+    threadJob = job;
+    threadEmitBuffer = &buffer;
+    if(job->splitMapper != NULL){
+        job->splitMapper(task->split);
+    }
+    else{
+        job->mapper(task->split->file_name);
+    }
+    threadEmitBuffer = NULL;
+    flushEmitBuffer(job, &buffer, (caching && cache.slots != NULL) ? &cache : NULL);
+    if(caching && cache.slots != NULL){
+        cacheCommit(&cache, job);
+    }
+    destroyEmitBuffer(&buffer);
+    threadJob = outerJob;
+    MR_TaskDone(job);
+}
+
+/**
+* Write a map output given as byte spans, e.g. token views from an MR_Reader.
+* Neither span needs to be NUL terminated; both are copied. Only mappers and
+* combiners may emit; reducers write their output with MR_Write / MR_Printf
+* Parameters:
+*     key           - Key of the output
+*     key_length    - Bytes in the key
+*     value         - Value of the output
+*     value_length  - Bytes in the value, under 4 GB
+*/
+void MR_EmitSpan(const char *key, size_t key_length, const char *value, size_t value_length){
+    assert(value_length <= UINT32_MAX);
+    if(threadCombineState != NULL){ // output of a combiner
+        CombineState *state = threadCombineState;
+        assert(key_length == state->keyLength && memcmp(key, state->key, key_length) == 0);
+        KeyValue *node = (KeyValue *)arenaAlloc(state->arena, sizeof(KeyValue));
+        node->key = state->key;
+        char *text = (char *)arenaAlloc(state->arena, MR_VALUE_SPACE(value_length));
+        node->value = storeValue(&text, value, value_length);
+        node->next = NULL;
+        if(state->head == NULL){
+            state->head = node;
         }
         else{
-            previous->next = node;
+            state->tail->next = node;
         }
+        state->tail = node;
+        state->count++;
+        state->valueBytes += MR_VALUE_SPACE(value_length);
+        return;
+    }
+    // Only map tasks and combiners emit: a reducer's partitions may already be merged or released
+    if(threadEmitBuffer == NULL){
+        fputs("MR_Emit called outside a map task or combiner\n", stderr);
+        abort();
     }
-    bucket->size ++;
-    pthread_mutex_unlock(&bucket->partitionMutex);
+    emitBufferInsert(threadEmitBuffer, key, key_length, value, value_length);
+}
+
+/**
+* Write a specifc map output, a <key, value> pair, to a partition
+* Pairs emitted from a map task are buffered per thread and only reach the
+* partitions as sorted runs when the task ends; MR_Reduce merges the runs.
+* Must be called from a mapper or combiner, see MR_EmitSpan
+* Parameters:
+*     key           - Key of the output
+*     value         - Value of the output
+*/
+void MR_Emit(char *key, char *value){
+    MR_EmitSpan(key, strlen(key), value, strlen(value));
+}
+
+/**
+* Write a map output with a binary key and value, either of which may
+* contain NUL bytes. Reducers read the value back with MR_GetNextBytes and
+* the key's length with MR_KeyLength
+* Parameters:
+*     key           - Key bytes
+*     key_length    - Bytes in the key
+*     value         - Value bytes
+*     value_length  - Bytes in the value, under 4 GB
+*/
+void MR_EmitBytes(const void *key, size_t key_length, const void *value, size_t value_length){
+    MR_EmitSpan((const char *)key, key_length, (const char *)value, value_length);
+}
+
+/**
+* Write a map output with a number as its value, stored as a varint of 1 to
+* 10 bytes rather than formatted text. Read it back with MR_GetNextU64
+* Parameters:
+*     key           - Key bytes
+*     key_length    - Bytes in the key
+*     value         - Value of the output
+*/
+void MR_EmitU64(const void *key, size_t key_length, uint64_t value){
+    char bytes[10];
+    MR_EmitSpan((const char *)key, key_length, bytes, varintEncode(bytes, value));
 }
-    
+
 /**
 * Hash a mapper's output to determine the partition that will hold it
 * Parameters:
@@ -173,11 +1903,34 @@ void MR_Emit(char *key, char *value){
 *     unsigned int  - Index of the partition
 */
 unsigned int MR_Partitioner(char *key, unsigned int num_partitions){
-    unsigned long hash = 5381;
-    int c;
-    while ((c = *key++) != '\0')
-    hash = hash * 33 + c;
-    return hash % num_partitions;
+    return MR_Hash(key) % num_partitions;
+}
+
+/**
+* Move a slot's runs and spills onto another slot of the same partition,
+* leaving the slot empty. Only called once the map phase is over
+* Parameters:
+*     into          - Slot to reduce the runs with
+*     from          - Slot to empty
+*/
+void adoptSlot(Bucket *into, Bucket *from){
+    Run **runTail = &into->runs;
+    while(*runTail != NULL){
+        runTail = &(*runTail)->next;
+    }
+    *runTail = from->runs;
+    Spill **spillTail = &into->spills;
+    while(*spillTail != NULL){
+        spillTail = &(*spillTail)->next;
+    }
+    *spillTail = from->spills;
+    into->size += from->size;
+    into->memoryBytes += from->memoryBytes;
+    into->spillBytes += from->spillBytes;
+    into->runCount += from->runCount;
+    from->runs = NULL;
+    from->spills = NULL;
+    releasePartition(from);
 }
 
 /**
@@ -188,73 +1941,167 @@ unsigned int MR_Partitioner(char *key, unsigned int num_partitions){
 */
 void MR_Reduce(void *threadarg){
     ThreadArgs *args = (ThreadArgs *)threadarg;
-    Bucket *bucket = partitions.bucket[args->partId];
-    pthread_mutex_lock(&bucket->partitionMutex);
-    // if(DEBUG){
-    //     if(args->partId == 9){
-    //         assert(bucket->size == 5000);
-    //     }
-    // }
+    MR_Job *job = (MR_Job *)args->job;
+    MR_Job *outerJob = threadJob;
+    threadJob = job;
     if(DEBUG){
         printf("\nThread ID: %lu Reducing Partition: %i", (unsigned long)pthread_self(), args->partId);
         fflush(stdout);}
-    
-    KeyValue *node = bucket->head;
-    while(node != NULL){
-        // if (DEBUG) {printf("\nPartition: %i . New Key %s (%lu)", args->partId, node->key, (unsigned long)pthread_self());
-        //     fflush(stdout);}
-        args->reducer(node->key, args->partId);
-        node = bucket->head;
+
+    // Gather the runs and spills of every slot assigned to the partition into
+    // the first one, so one merge hands the reducer all of the keys in order
+    Bucket *bucket = NULL;
+    for(unsigned int slot = 0; slot < job->numSlots; slot++){
+        Bucket *other = job->bucket[slot];
+        if(job->slotPartition[slot] != args->partId || other->size == 0){
+            continue;
+        }
+        if(bucket == NULL){
+            bucket = other;
+        }
+        else{
+            adoptSlot(bucket, other);
+        }
+    }
+    if(bucket != NULL){
+        mergeInit(&bucket->merge, bucket->runs, bucket->spills);
+        job->reducing[args->partId] = bucket;
+        Merge *merge = &bucket->merge;
+        while(merge->count > 0){
+            char *key = merge->heap[0].next->key;
+            merge->key = key;
+            args->reducer(key, args->partId);
+            // skip any values the reducer left unread
+            while(merge->count > 0 && MR_SameKey(merge->heap[0].next->key, key)){
+                mergeAdvance(merge);
+            }
+        }
+        // Partition fully consumed, give its memory and spill files back now rather than at the end of the job
+        releasePartition(bucket);
     }
+    job->reducing[args->partId] = NULL;
+    closeOutput(&job->output[args->partId]); // one open, a few large writes and one close per partition
     free(threadarg);
-    pthread_mutex_unlock(&bucket->partitionMutex);  
+    threadJob = outerJob;
+    ThreadPool_latch_count_down(&job->reduced);
 }
 
 /**
-* Get the next value of the given key in the partition
+* Get a view of the next value of the given key in the partition, or of the map
+* task's local values when called from a combiner. The view points into the
+* framework's storage: it must not be freed and is only valid until the reduce
+* (or combine) call for this key returns
 * Parameters:
 *     key           - Key of the values being reduced
 *     partition_idx - Index of the partition containing this key
 * Return:
-*     char *        - Value of the next <key, value> pair if its key is the current key
+*     const char *  - Value of the next <key, value> pair if its key is the current key
 *     NULL          - Otherwise
 */
-char *MR_GetNext(char *key, unsigned int partition_idx) {
-    Bucket *bucket = partitions.bucket[partition_idx];
-    
-    if (bucket->head == NULL){ //list is empty 
+const char *MR_GetNextView(char *key, unsigned int partition_idx) {
+    (void)key; // kept for API compatibility, the current key comes from the merge cursor
+    if(threadCombineState != NULL){ // called from a combiner, read the map task's local values
+        KeyValue *node = threadCombineState->next;
+        if(node == NULL){
+            return NULL;
+        }
+        threadCombineState->next = node->next;
+        return node->value;
+    }
+    Bucket *bucket = threadJob->reducing[partition_idx];
+    if(bucket == NULL || bucket->merge.count == 0){
+        return NULL;
+    }
+    KeyValue *node = bucket->merge.heap[0].next;
+    if(!MR_SameKey(node->key, bucket->merge.key)){ // current key has been reduced
         return NULL;
     }
-    if(strcmp(bucket->head->key, key) !=0){ // current key has been reduced 
+    mergeAdvance(&bucket->merge);
+    return node->value;
+}
+
+/**
+* Get the next value of the given key in the partition, or of the map task's
+* local values when called from a combiner
+* Parameters:
+*     key           - Key of the values being reduced
+*     partition_idx - Index of the partition containing this key
+* Return:
+*     char *        - Copy of the next value if its key is the current key, to be freed by the caller
+*     NULL          - Otherwise
+*/
+char *MR_GetNext(char *key, unsigned int partition_idx) {
+    const char *value = MR_GetNextView(key, partition_idx);
+    if(value == NULL){
         return NULL;
     }
-    KeyValue *node = bucket->head->next;
-    // Case 1: Bucket head-> next matches key
-    if (node != NULL && strcmp(node->key, key) == 0) { 
-        // remove and return 
-        bucket->head->next = node->next; //remove from list 
-        char *value = strdup(node->value); // Duplicate the value
-        // free(node->key);
-        // free(node->value);
-        // free(node);
-        bucket->size--;  // Adjust the size of the bucket
-        assert(bucket->size > 0);
-        return value;
-    }
-    // Case 2: last instance in the list or next instence is different key 
-    else if (node == NULL || strcmp(node->key, key) != 0 ){ 
-        // pop bucket head and return 
-        char *value = strdup(bucket->head->value); // Duplicate the value
-        // free(bucket->head->key);
-        // free(bucket->head->value);
-        // free(bucket->head);
-        bucket->head = node;
-        bucket->size--;  // Adjust the size of the bucket
-        // assert(bucket->size == 0 );
-        return value;
-    }
-    else {
-        return NULL;  // Fall through 
+    return strdup(value);
+}
+
+/**
+* Get a view of the next value of the given key as bytes, see MR_GetNextView
+* Parameters:
+*     key           - Key of the values being reduced
+*     partition_idx - Index of the partition containing this key
+*     length        - Set to the bytes in the value
+* Return:
+*     const void *  - Value of the next <key, value> pair if its key is the current key
+*     NULL          - Otherwise
+*/
+const void *MR_GetNextBytes(char *key, unsigned int partition_idx, size_t *length) {
+    const char *value = MR_GetNextView(key, partition_idx);
+    if(value != NULL){
+        *length = MR_ValueLength(value);
+    }
+    return value;
+}
+
+/**
+* Get the next value of the given key emitted with MR_EmitU64
+* Parameters:
+*     key           - Key of the values being reduced
+*     partition_idx - Index of the partition containing this key
+*     value         - Set to the value
+* Return:
+*     true          - If a value was read
+*     false         - If the key has no values left
+*/
+bool MR_GetNextU64(char *key, unsigned int partition_idx, uint64_t *value) {
+    size_t length;
+    const char *bytes = (const char *)MR_GetNextBytes(key, partition_idx, &length);
+    if(bytes == NULL){
+        return false;
     }
+    bool decoded = varintDecode(bytes, length, value);
+    assert(decoded); // every value of the key must come from MR_EmitU64
+    (void)decoded;
+    return true;
+}
+
+/**
+* Append bytes to the output file of a partition. Only the reducer of that
+* partition may call this; writes are buffered and the file is opened on the
+* first write and closed once the partition has been reduced
+* Parameters:
+*     partition_idx - Index of the partition being reduced
+*     data          - Bytes to write
+*     length        - Number of bytes
+*/
+void MR_Write(unsigned int partition_idx, const char *data, size_t length){
+    outputWrite(&threadJob->output[partition_idx], data, length);
+}
+
+/**
+* Append formatted text to the output file of a partition, see MR_Write
+* Parameters:
+*     partition_idx - Index of the partition being reduced
+*     format        - printf format
+*/
+void MR_Printf(unsigned int partition_idx, const char *format, ...){
+    va_list args;
+    va_start(args, format);
+    outputVprintf(&threadJob->output[partition_idx], format, args);
+    va_end(args);
 }
+
 #endif
@@ -0,0 +1,830 @@
+#ifndef MULTIPROCESS_H
+#define MULTIPROCESS_H
+#include "mapreduce.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+// Multi-process driver. A coordinator (the calling process) forks worker
+// processes, each running jobs on its own ThreadPool_t, and talks to them
+// over SOCK_SEQPACKET Unix domain sockets:
+//   map     - a worker maps a batch of splits with a local job whose reducer
+//             writes every partition out in the spill format, one sorted
+//             key group per key, into a memfd (shared memory) per partition.
+//             The descriptors are passed to the coordinator with SCM_RIGHTS,
+//             so the data outlives the worker that produced it
+//   reduce  - once every split is mapped, the coordinator passes each
+//             partition's shuffle files to one worker, which k-way merges
+//             them like spilled runs and calls the user's reducer
+// A worker that dies (a crashing mapper, the OOM killer) only loses its
+// current task, which is run again on a fresh worker. A batch that fails is
+// split into single splits or partitions, and one that fails
+// MR_PROCESS_MAX_ATTEMPTS times is given up on, so one poisonous input
+// costs its own split and not the job.
+
+#define MR_PROCESS_MAX_ITEMS 64         // Splits or partitions per task, and descriptors per message
+#define MR_PROCESS_MAX_ATTEMPTS 3       // Runs of a single split or partition before it is given up on
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1U
+#endif
+
+typedef enum {
+    MR_MESSAGE_MAP,                     // Coordinator: map the splits in items
+    MR_MESSAGE_INPUT,                   // Coordinator: shuffle files to reduce, one descriptor per item
+    MR_MESSAGE_REDUCE,                  // Coordinator: reduce the partitions in items from the inputs sent so far
+    MR_MESSAGE_OUTPUT,                  // Worker: shuffle files of the map task, one descriptor per item
+    MR_MESSAGE_DONE,                    // Worker: task finished, all its output has been sent
+    MR_MESSAGE_EXIT                     // Coordinator: no more work
+} MR_MessageType;
+
+typedef struct MR_Message {
+    MR_MessageType type;
+    unsigned int count;                 // Entries used in the arrays
+    unsigned int items[MR_PROCESS_MAX_ITEMS]; // Split indices, or partitions
+    size_t records[MR_PROCESS_MAX_ITEMS];     // INPUT and OUTPUT: pairs in each shuffle file
+    size_t bytes[MR_PROCESS_MAX_ITEMS];       // INPUT and OUTPUT: size of each shuffle file
+} MR_Message;
+
+typedef struct MR_ShuffleFile {
+    int fd;                             // memfd, or an unlinked spill file where memfd is missing
+    unsigned int partition;
+    size_t records;
+    size_t bytes;
+} MR_ShuffleFile;
+
+typedef enum {
+    MR_TASK_PENDING,
+    MR_TASK_RUNNING,
+    MR_TASK_FINISHED,
+    MR_TASK_ABANDONED                   // Failed too often, or split into smaller tasks
+} MR_TaskState;
+
+typedef struct MR_ProcessTask {
+    bool reduce;
+    MR_TaskState state;
+    unsigned int attempts;              // Runs that ended with the worker dying
+    unsigned int count;
+    unsigned int items[MR_PROCESS_MAX_ITEMS];
+} MR_ProcessTask;
+
+typedef struct MR_ProcessWorker {
+    pid_t pid;                          // -1 once the worker is gone
+    int sock;                           // Coordinator's end of the socket pair
+    int task;                           // Task being run, -1 when idle
+    MR_ShuffleFile *pending;            // Output of the running map task, committed on DONE
+    unsigned int pendingCount;
+    unsigned int pendingCapacity;
+} MR_ProcessWorker;
+
+typedef struct MR_Coordinator {
+    const MR_Split *splits;
+    unsigned int splitCount;
+    SplitMapper mapper;
+    Reducer reducer;
+    const MR_Options *options;
+    MR_ProcessWorker *workers;
+    unsigned int workerCount;
+    MR_ProcessTask *tasks;
+    unsigned int taskCount;
+    unsigned int taskCapacity;
+    MR_ShuffleFile *files;              // Shuffle files of finished map tasks
+    unsigned int fileCount;
+    unsigned int fileCapacity;
+    off_t *outputSizes;                 // Size of each partition's output file before the job, -1 if absent
+    bool failed;                        // Some input was given up on
+} MR_Coordinator;
+
+typedef struct MR_ShufflePartition {
+    int fd;                             // -1 until the partition's first key
+    Output output;
+    size_t records;
+    bool failed;                        // The shuffle file could not be created or written
+    char *values;                       // Framed values of the key being written
+    size_t capacity;
+} MR_ShufflePartition;
+
+MR_ShufflePartition *processShuffle = NULL; // Worker process only: outputs of the map task being run
+
+/**
+* Send a message, with descriptors attached if any. Never raises SIGPIPE, a
+* peer that is gone is noticed by poll
+* Parameters:
+*     sock          - Socket to send on
+*     message       - Message to send
+*     fds           - Descriptors to pass, duplicated into the receiver
+*     fdCount       - Number of descriptors, at most MR_PROCESS_MAX_ITEMS
+* Return:
+*     true          - On success
+*     false         - Otherwise
+*/
+bool MR_SendMessage(int sock, const MR_Message *message, const int *fds, unsigned int fdCount){
+    struct iovec iov = {(void *)message, sizeof(MR_Message)};
+    struct msghdr header;
+    char control[CMSG_SPACE(sizeof(int) * MR_PROCESS_MAX_ITEMS)];
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    if(fdCount > 0){
+        memset(control, 0, sizeof(control));
+        header.msg_control = control;
+        header.msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fdCount);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fdCount);
+    }
+    ssize_t sent;
+    do{
+        sent = sendmsg(sock, &header, MSG_NOSIGNAL);
+    }while(sent < 0 && errno == EINTR);
+    return sent == (ssize_t)sizeof(MR_Message);
+}
+
+/**
+* Receive a message and the descriptors attached to it
+* Parameters:
+*     sock          - Socket to read from
+*     message       - Filled in
+*     fds           - At least MR_PROCESS_MAX_ITEMS entries, filled in
+*     fdCount       - Set to the number of descriptors received
+* Return:
+*     true          - On success
+*     false         - If the peer is gone or sent something malformed
+*/
+bool MR_ReceiveMessage(int sock, MR_Message *message, int *fds, unsigned int *fdCount){
+    struct iovec iov = {message, sizeof(MR_Message)};
+    struct msghdr header;
+    char control[CMSG_SPACE(sizeof(int) * MR_PROCESS_MAX_ITEMS)];
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+    ssize_t got;
+    do{
+        got = recvmsg(sock, &header, MSG_CMSG_CLOEXEC);
+    }while(got < 0 && errno == EINTR);
+    *fdCount = 0;
+    if(got > 0){
+        for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg != NULL; cmsg = CMSG_NXTHDR(&header, cmsg)){
+            if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+                unsigned int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                memcpy(fds + *fdCount, CMSG_DATA(cmsg), sizeof(int) * count);
+                *fdCount += count;
+            }
+        }
+    }
+    if(got != (ssize_t)sizeof(MR_Message) || (header.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || message->count > MR_PROCESS_MAX_ITEMS){
+        for(unsigned int i = 0; i < *fdCount; i++){
+            close(fds[i]);
+        }
+        *fdCount = 0;
+        return false;
+    }
+    return true;
+}
+
+/**
+* Create a shuffle file: a memfd, so the data lives in shared memory and can
+* be handed to another process by descriptor, or an unlinked spill file on
+* kernels without memfd_create
+* Parameters:
+*     dir           - Directory for the fallback file
+* Return:
+*     int           - Descriptor open for reading and writing, -1 on failure
+*/
+int MR_ShuffleCreate(const char *dir){
+    int fd = (int)syscall(SYS_memfd_create, "mr-shuffle", MFD_CLOEXEC);
+    return (fd >= 0) ? fd : spillCreate(dir);
+}
+
+/**
+* Reducer of a worker's map job: writes the key and all its values as one
+* spill file key group to the partition's shuffle file. Keys arrive in order,
+* so the file is a sorted run that MR_Reduce can merge as a spill
+* Parameters:
+*     key           - Key being reduced
+*     partition_idx - Partition of the key
+*/
+void MR_ShuffleReduce(char *key, unsigned int partition_idx){
+    MR_ShufflePartition *partition = &processShuffle[partition_idx];
+    if(partition->fd < 0 && !partition->failed){
+        partition->fd = MR_ShuffleCreate(threadJob->spillDir);
+        if(partition->fd < 0){
+            partition->failed = true;
+        }
+        else{
+            initOutputFd(&partition->output, partition->fd, "shuffle");
+        }
+    }
+    uint64_t count = 0;
+    size_t used = 0, length;
+    const char *value;
+    while((value = (const char *)MR_GetNextBytes(key, partition_idx, &length)) != NULL){
+        size_t space = MR_VALUE_SPACE(length);
+        if(used + space > partition->capacity){
+            partition->capacity = (used + space > 2 * partition->capacity) ? used + space : 2 * partition->capacity;
+            partition->values = (char *)realloc(partition->values, partition->capacity);
+        }
+        memcpy(partition->values + used, value - MR_VALUE_HEADER(length), space); // length header, bytes and NUL
+        used += space;
+        count++;
+    }
+    if(partition->failed){
+        return;
+    }
+    size_t keyLength = MR_KeyLength(key);
+    spillWriteVarint(&partition->output, keyLength);
+    spillWriteVarint(&partition->output, count);
+    spillWriteVarint(&partition->output, used);
+    outputWrite(&partition->output, key, keyLength);
+    outputWrite(&partition->output, partition->values, used);
+    partition->records += count;
+}
+
+/**
+* Worker side of a map task: map the splits with a local job and send the
+* coordinator one shuffle file per non-empty partition
+* Parameters:
+*     sock          - Socket to the coordinator
+*     pool          - The worker's pool
+*     splits        - Every split of the job
+*     message       - MAP message naming the splits to map
+*     mapper        - User's map function
+*     options       - Job options with rebalancing off
+* Return:
+*     true          - If the task's output was sent
+*     false         - Otherwise, the worker should exit so the task is run again
+*/
+bool MR_ProcessMap(int sock, ThreadPool_t *pool, const MR_Split *splits, const MR_Message *message, SplitMapper mapper, const MR_Options *options){
+    MR_Split *batch = (MR_Split *)malloc(sizeof(MR_Split) * message->count);
+    for(unsigned int i = 0; i < message->count; i++){
+        batch[i] = splits[message->items[i]];
+    }
+    for(unsigned int p = 0; p < options->num_parts; p++){
+        processShuffle[p].fd = -1;
+        processShuffle[p].records = 0;
+        processShuffle[p].failed = false;
+    }
+    MR_Job *job = MR_NewJob(pool, NULL, mapper, MR_ShuffleReduce, options);
+    MR_SubmitMaps(job, batch, message->count);
+    MR_Wait(job);
+
+    bool ok = true;
+    MR_Message reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.type = MR_MESSAGE_OUTPUT;
+    int fds[MR_PROCESS_MAX_ITEMS];
+    for(unsigned int p = 0; p <= options->num_parts; p++){
+        if(p < options->num_parts && processShuffle[p].fd >= 0){
+            MR_ShufflePartition *partition = &processShuffle[p];
+            ok = detachOutput(&partition->output) && ok;
+            reply.items[reply.count] = p;
+            reply.records[reply.count] = partition->records;
+            reply.bytes[reply.count] = lseek(partition->fd, 0, SEEK_END);
+            fds[reply.count++] = partition->fd;
+        }
+        ok = ok && !(p < options->num_parts && processShuffle[p].failed);
+        if(reply.count == MR_PROCESS_MAX_ITEMS || (p == options->num_parts && reply.count > 0)){
+            ok = ok && MR_SendMessage(sock, &reply, fds, reply.count);
+            for(unsigned int i = 0; i < reply.count; i++){
+                close(fds[i]); // the coordinator holds its own copy now
+            }
+            reply.count = 0;
+        }
+    }
+    reply.type = MR_MESSAGE_DONE;
+    return ok && MR_SendMessage(sock, &reply, NULL, 0);
+}
+
+/**
+* Main loop of a worker process: run the tasks the coordinator sends until
+* told to exit or the coordinator goes away
+* Parameters:
+*     sock          - Socket to the coordinator
+*     splits        - Every split of the job
+*     mapper        - User's map function
+*     reducer       - User's reduce function
+*     options       - Job options
+* Return:
+*     int           - Exit status for the process
+*/
+int MR_ProcessWorkerMain(int sock, const MR_Split *splits, SplitMapper mapper, Reducer reducer, const MR_Options *options){
+    ThreadPool_t *pool = ThreadPool_create_affinity(options->num_workers, options->scheduler, options->affinity);
+    MR_Options local = *options;
+    local.rebalance = false; // one slot per partition, so each shuffle file comes out in key order
+    local.partition_stats = NULL;
+    processShuffle = (MR_ShufflePartition *)calloc(options->num_parts, sizeof(MR_ShufflePartition));
+    MR_Job *reduceJob = NULL;
+    MR_Message message;
+    int fds[MR_PROCESS_MAX_ITEMS];
+    unsigned int fdCount;
+    int status = EXIT_SUCCESS;
+    while(MR_ReceiveMessage(sock, &message, fds, &fdCount) && message.type != MR_MESSAGE_EXIT){
+        if(message.type == MR_MESSAGE_MAP){
+            if(!MR_ProcessMap(sock, pool, splits, &message, mapper, &local)){
+                status = EXIT_FAILURE;
+                break;
+            }
+        }
+        else if(message.type == MR_MESSAGE_INPUT && fdCount == message.count){
+            if(reduceJob == NULL){
+                reduceJob = MR_NewJob(pool, NULL, NULL, reducer, &local);
+            }
+            for(unsigned int i = 0; i < message.count; i++){
+                if(message.items[i] >= local.num_parts){
+                    close(fds[i]);
+                    continue;
+                }
+                Bucket *bucket = reduceJob->bucket[message.items[i]];
+                addSpill(bucket, fds[i], NULL, 0, message.bytes[i]);
+                bucket->size += message.records[i];
+            }
+        }
+        else if(message.type == MR_MESSAGE_REDUCE){
+            if(reduceJob == NULL){
+                reduceJob = MR_NewJob(pool, NULL, NULL, reducer, &local);
+            }
+            MR_SubmitReducers(reduceJob);
+            MR_Wait(reduceJob); // closes the shuffle files
+            reduceJob = NULL;
+            message.type = MR_MESSAGE_DONE;
+            message.count = 0;
+            if(!MR_SendMessage(sock, &message, NULL, 0)){
+                break;
+            }
+        }
+        else{
+            for(unsigned int i = 0; i < fdCount; i++){
+                close(fds[i]);
+            }
+            status = EXIT_FAILURE;
+            break;
+        }
+    }
+    ThreadPool_destroy(pool);
+    for(unsigned int p = 0; p < options->num_parts; p++){
+        free(processShuffle[p].values);
+    }
+    free(processShuffle);
+    close(sock);
+    return status;
+}
+
+void MR_CloseShuffleFiles(MR_ShuffleFile *files, unsigned int count){
+    for(unsigned int i = 0; i < count; i++){
+        if(files[i].fd >= 0){
+            close(files[i].fd);
+            files[i].fd = -1;
+        }
+    }
+}
+
+/**
+* Fork worker w with a fresh socket pair. The child drops the coordinator's
+* descriptors, runs MR_ProcessWorkerMain and never returns
+* Parameters:
+*     coordinator   - Coordinator
+*     w             - Worker slot to fill
+* Return:
+*     true          - If the worker was started
+*     false         - Otherwise
+*/
+bool MR_SpawnWorker(MR_Coordinator *coordinator, unsigned int w){
+    int pair[2];
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) != 0){
+        perror("socketpair");
+        return false;
+    }
+    fflush(NULL); // the child would otherwise write out the parent's buffered output again
+    pid_t pid = fork();
+    if(pid < 0){
+        perror("fork");
+        close(pair[0]);
+        close(pair[1]);
+        return false;
+    }
+    if(pid == 0){
+        close(pair[0]);
+        for(unsigned int i = 0; i < coordinator->workerCount; i++){
+            MR_ProcessWorker *other = &coordinator->workers[i];
+            if(other->sock >= 0){
+                close(other->sock);
+            }
+            MR_CloseShuffleFiles(other->pending, other->pendingCount);
+        }
+        MR_CloseShuffleFiles(coordinator->files, coordinator->fileCount);
+        int status = MR_ProcessWorkerMain(pair[1], coordinator->splits, coordinator->mapper, coordinator->reducer, coordinator->options);
+        fflush(NULL);
+        _exit(status); // skip the caller's atexit handlers
+    }
+    close(pair[1]);
+    MR_ProcessWorker *worker = &coordinator->workers[w];
+    worker->pid = pid;
+    worker->sock = pair[0];
+    worker->task = -1;
+    worker->pendingCount = 0;
+    return true;
+}
+
+unsigned int MR_AddTask(MR_Coordinator *coordinator, bool reduce, const unsigned int *items, unsigned int count, unsigned int attempts){
+    if(coordinator->taskCount == coordinator->taskCapacity){
+        coordinator->taskCapacity = (coordinator->taskCapacity > 0) ? 2 * coordinator->taskCapacity : 64;
+        coordinator->tasks = (MR_ProcessTask *)realloc(coordinator->tasks, sizeof(MR_ProcessTask) * coordinator->taskCapacity);
+    }
+    MR_ProcessTask *task = &coordinator->tasks[coordinator->taskCount];
+    task->reduce = reduce;
+    task->state = MR_TASK_PENDING;
+    task->attempts = attempts;
+    task->count = count;
+    memcpy(task->items, items, sizeof(unsigned int) * count);
+    return coordinator->taskCount++;
+}
+
+/**
+* Hand a task to an idle worker. A reduce task first gets every shuffle file
+* of its partitions. A failed send is left to poll, which sees the worker hang up
+* Parameters:
+*     coordinator   - Coordinator
+*     w             - Idle, running worker
+*     t             - Pending task
+*/
+void MR_AssignTask(MR_Coordinator *coordinator, unsigned int w, unsigned int t){
+    MR_ProcessWorker *worker = &coordinator->workers[w];
+    MR_ProcessTask *task = &coordinator->tasks[t];
+    MR_Message message;
+    memset(&message, 0, sizeof(message));
+    bool ok = true;
+    if(task->reduce){
+        int fds[MR_PROCESS_MAX_ITEMS];
+        message.type = MR_MESSAGE_INPUT;
+        for(unsigned int f = 0; f <= coordinator->fileCount && ok; f++){
+            MR_ShuffleFile *file = &coordinator->files[(f < coordinator->fileCount) ? f : 0];
+            bool wanted = false;
+            for(unsigned int i = 0; i < task->count && f < coordinator->fileCount; i++){
+                wanted = wanted || file->partition == task->items[i];
+            }
+            if(wanted){
+                message.items[message.count] = file->partition;
+                message.records[message.count] = file->records;
+                message.bytes[message.count] = file->bytes;
+                fds[message.count++] = file->fd;
+            }
+            if(message.count == MR_PROCESS_MAX_ITEMS || (f == coordinator->fileCount && message.count > 0)){
+                ok = MR_SendMessage(worker->sock, &message, fds, message.count);
+                message.count = 0;
+            }
+        }
+        message.type = MR_MESSAGE_REDUCE;
+    }
+    else{
+        message.type = MR_MESSAGE_MAP;
+    }
+    message.count = task->count;
+    memcpy(message.items, task->items, sizeof(unsigned int) * task->count);
+    if(ok){
+        MR_SendMessage(worker->sock, &message, NULL, 0);
+    }
+    task->state = MR_TASK_RUNNING;
+    worker->task = t;
+    if(DEBUG){printf("\nProcess %d runs %s task %u (%u items)", (int)worker->pid, task->reduce ? "reduce" : "map", t, task->count);
+        fflush(stdout);}
+}
+
+/**
+* Requeue the task of a worker that died. A batch is split into single
+* splits or partitions so a bad input only takes itself down; a single one
+* is given up on after MR_PROCESS_MAX_ATTEMPTS runs. Output a reduce task
+* appended before dying is cut off again first
+* Parameters:
+*     coordinator   - Coordinator
+*     t             - Task that was running
+*/
+void MR_RetryTask(MR_Coordinator *coordinator, unsigned int t){
+    MR_ProcessTask *task = &coordinator->tasks[t];
+    task->attempts++;
+    if(task->reduce){
+        char path[PATH_MAX];
+        for(unsigned int i = 0; i < task->count; i++){
+            snprintf(path, sizeof(path), coordinator->options->output_format, task->items[i]);
+            off_t size = coordinator->outputSizes[task->items[i]];
+            if((size < 0) ? (unlink(path) != 0 && errno != ENOENT) : (truncate(path, size) != 0)){
+                perror(path);
+            }
+        }
+    }
+    if(task->count > 1){
+        task->state = MR_TASK_ABANDONED;
+        MR_ProcessTask copy = *task; // adding tasks may move the array
+        for(unsigned int i = 0; i < copy.count; i++){
+            MR_AddTask(coordinator, copy.reduce, &copy.items[i], 1, copy.attempts);
+        }
+    }
+    else if(task->attempts >= MR_PROCESS_MAX_ATTEMPTS){
+        task->state = MR_TASK_ABANDONED;
+        coordinator->failed = true;
+        if(task->reduce){
+            fprintf(stderr, "MapReduce: giving up on partition %u after %u failed attempts\n", task->items[0], task->attempts);
+        }
+        else{
+            const MR_Split *split = &coordinator->splits[task->items[0]];
+            fprintf(stderr, "MapReduce: giving up on %s bytes %lld-%lld after %u failed attempts\n", split->file_name,
+                (long long)split->offset, (long long)(split->offset + split->length), task->attempts);
+        }
+    }
+    else{
+        task->state = MR_TASK_PENDING;
+    }
+}
+
+/**
+* Reap a worker whose socket hung up or misbehaved, and requeue its task
+* Parameters:
+*     coordinator   - Coordinator
+*     w             - Worker that is gone
+*/
+void MR_WorkerGone(MR_Coordinator *coordinator, unsigned int w){
+    MR_ProcessWorker *worker = &coordinator->workers[w];
+    int status;
+    close(worker->sock);
+    kill(worker->pid, SIGKILL); // no-op if it already died
+    while(waitpid(worker->pid, &status, 0) < 0 && errno == EINTR){
+    }
+    if(WIFSIGNALED(status) && WTERMSIG(status) != SIGKILL){
+        fprintf(stderr, "MapReduce: worker process %d killed by signal %d\n", (int)worker->pid, WTERMSIG(status));
+    }
+    else if(WIFEXITED(status) && WEXITSTATUS(status) != EXIT_SUCCESS){
+        fprintf(stderr, "MapReduce: worker process %d exited with status %d\n", (int)worker->pid, WEXITSTATUS(status));
+    }
+    MR_CloseShuffleFiles(worker->pending, worker->pendingCount);
+    worker->pendingCount = 0;
+    worker->pid = -1;
+    worker->sock = -1;
+    if(worker->task >= 0){
+        MR_RetryTask(coordinator, worker->task);
+        worker->task = -1;
+    }
+}
+
+/**
+* Handle a message from a worker
+* Parameters:
+*     coordinator   - Coordinator
+*     w             - Worker the message came from
+*     message       - Message
+*     fds           - Descriptors that came with it
+*     fdCount       - Number of descriptors
+* Return:
+*     true          - If the message made sense
+*     false         - Otherwise, the worker is to be treated as dead
+*/
+bool MR_HandleMessage(MR_Coordinator *coordinator, unsigned int w, const MR_Message *message, const int *fds, unsigned int fdCount){
+    MR_ProcessWorker *worker = &coordinator->workers[w];
+    if(worker->task < 0){
+        return false;
+    }
+    MR_ProcessTask *task = &coordinator->tasks[worker->task];
+    if(message->type == MR_MESSAGE_OUTPUT && !task->reduce && fdCount == message->count){
+        for(unsigned int i = 0; i < message->count; i++){
+            if(worker->pendingCount == worker->pendingCapacity){
+                worker->pendingCapacity = (worker->pendingCapacity > 0) ? 2 * worker->pendingCapacity : 64;
+                worker->pending = (MR_ShuffleFile *)realloc(worker->pending, sizeof(MR_ShuffleFile) * worker->pendingCapacity);
+            }
+            MR_ShuffleFile *file = &worker->pending[worker->pendingCount++];
+            file->fd = fds[i];
+            file->partition = message->items[i];
+            file->records = message->records[i];
+            file->bytes = message->bytes[i];
+            if(file->partition >= coordinator->options->num_parts){
+                return false;
+            }
+        }
+        return true;
+    }
+    if(message->type != MR_MESSAGE_DONE || fdCount > 0){
+        return false;
+    }
+    if(task->reduce){ // the partitions are written out, their shuffle files can go
+        for(unsigned int f = 0; f < coordinator->fileCount; f++){
+            for(unsigned int i = 0; i < task->count; i++){
+                if(coordinator->files[f].fd >= 0 && coordinator->files[f].partition == task->items[i]){
+                    close(coordinator->files[f].fd);
+                    coordinator->files[f].fd = -1;
+                }
+            }
+        }
+    }
+    else{
+        if(coordinator->fileCount + worker->pendingCount > coordinator->fileCapacity){
+            coordinator->fileCapacity = 2 * (coordinator->fileCount + worker->pendingCount);
+            coordinator->files = (MR_ShuffleFile *)realloc(coordinator->files, sizeof(MR_ShuffleFile) * coordinator->fileCapacity);
+        }
+        memcpy(coordinator->files + coordinator->fileCount, worker->pending, sizeof(MR_ShuffleFile) * worker->pendingCount);
+        coordinator->fileCount += worker->pendingCount;
+        worker->pendingCount = 0;
+    }
+    task->state = MR_TASK_FINISHED;
+    worker->task = -1;
+    return true;
+}
+
+/**
+* Queue the reduce tasks once every split is mapped. Partitions are dealt
+* largest first round robin over the tasks, so each worker gets a mix of sizes
+* Parameters:
+*     coordinator   - Coordinator
+*     batch         - Partitions per task
+*/
+void MR_PlanReduceTasks(MR_Coordinator *coordinator, unsigned int batch){
+    unsigned int numParts = coordinator->options->num_parts;
+    SlotLoad *loads = (SlotLoad *)calloc(numParts, sizeof(SlotLoad));
+    for(unsigned int p = 0; p < numParts; p++){
+        loads[p].slot = p;
+    }
+    for(unsigned int f = 0; f < coordinator->fileCount; f++){
+        loads[coordinator->files[f].partition].bytes += coordinator->files[f].bytes;
+    }
+    qsort(loads, numParts, sizeof(SlotLoad), compareSlotLoads);
+    unsigned int used = 0;
+    while(used < numParts && loads[used].bytes > 0){
+        used++;
+    }
+    unsigned int taskCount = (used + batch - 1) / batch;
+    for(unsigned int t = 0; t < taskCount; t++){
+        unsigned int items[MR_PROCESS_MAX_ITEMS], count = 0;
+        for(unsigned int i = t; i < used; i += taskCount){
+            items[count++] = loads[i].slot;
+        }
+        MR_AddTask(coordinator, true, items, count, 0);
+    }
+    free(loads);
+}
+
+/**
+* Run a MapReduce job over num_processes worker processes, each with a pool of
+* options->num_workers threads. Map outputs are shuffled through shared memory
+* and Unix domain sockets; a worker that crashes only costs its current task,
+* which is rerun elsewhere. The coordinator, the calling process, runs no
+* user code
+* Parameters:
+*     file_count    - Number of files
+*     file_names    - Array of filenames
+*     mapper        - Function pointer to the split map function
+*     reducer       - Function pointer to the reduce function
+*     options       - Combiner, pool, partition and split settings, see MR_DefaultOptions.
+*                     rebalance is ignored, each partition is reduced by one worker process
+*     num_processes - Number of worker processes
+* Return:
+*     true          - If every split was mapped and every partition reduced
+*     false         - If some input was given up on after repeated crashes
+*/
+bool MR_RunProcesses(
+    unsigned int file_count, char *file_names[],
+    SplitMapper mapper, Reducer reducer, const MR_Options *options, unsigned int num_processes){
+    MR_Coordinator coordinator;
+    memset(&coordinator, 0, sizeof(coordinator));
+    coordinator.splits = MR_PlanSplits(file_count, file_names, options->split_size, &coordinator.splitCount);
+    coordinator.mapper = mapper;
+    coordinator.reducer = reducer;
+    coordinator.options = options;
+    coordinator.workerCount = (num_processes > 0) ? num_processes : 1;
+    coordinator.workers = (MR_ProcessWorker *)calloc(coordinator.workerCount, sizeof(MR_ProcessWorker));
+    coordinator.outputSizes = (off_t *)malloc(sizeof(off_t) * options->num_parts);
+    for(unsigned int p = 0; p < options->num_parts; p++){
+        char path[PATH_MAX];
+        struct stat info;
+        snprintf(path, sizeof(path), options->output_format, p);
+        coordinator.outputSizes[p] = (stat(path, &info) == 0) ? info.st_size : -1;
+    }
+    raiseFileLimit(); // the coordinator holds a shuffle file per map task and partition
+
+    // Batches just big enough to keep every thread of every worker busy
+    unsigned int threads = (options->num_workers > 0) ? options->num_workers : 1;
+    unsigned int mapBatch = (coordinator.splitCount + coordinator.workerCount - 1) / coordinator.workerCount;
+    mapBatch = (mapBatch > threads) ? threads : (mapBatch > 0 ? mapBatch : 1);
+    mapBatch = (mapBatch > MR_PROCESS_MAX_ITEMS) ? MR_PROCESS_MAX_ITEMS : mapBatch;
+    for(unsigned int i = 0; i < coordinator.splitCount; i += mapBatch){
+        unsigned int items[MR_PROCESS_MAX_ITEMS], count = 0;
+        for(unsigned int j = i; j < i + mapBatch && j < coordinator.splitCount; j++){
+            items[count++] = j;
+        }
+        MR_AddTask(&coordinator, false, items, count, 0);
+    }
+    for(unsigned int w = 0; w < coordinator.workerCount; w++){
+        coordinator.workers[w].pid = -1;
+        coordinator.workers[w].sock = -1;
+        coordinator.workers[w].task = -1;
+    }
+    for(unsigned int w = 0; w < coordinator.workerCount; w++){
+        MR_SpawnWorker(&coordinator, w);
+    }
+
+    bool reducing = false;
+    struct pollfd *polls = (struct pollfd *)malloc(sizeof(struct pollfd) * coordinator.workerCount);
+    unsigned int *polled = (unsigned int *)malloc(sizeof(unsigned int) * coordinator.workerCount);
+    while(1){
+        unsigned int next = 0, live = 0, unfinished = 0;
+        for(unsigned int t = 0; t < coordinator.taskCount; t++){
+            unfinished += (coordinator.tasks[t].state == MR_TASK_PENDING || coordinator.tasks[t].state == MR_TASK_RUNNING);
+        }
+        if(unfinished == 0){
+            if(reducing){
+                break;
+            }
+            reducing = true;
+            unsigned int reduceBatch = (options->num_parts + coordinator.workerCount - 1) / coordinator.workerCount;
+            reduceBatch = (reduceBatch > threads) ? threads : (reduceBatch > 0 ? reduceBatch : 1);
+            MR_PlanReduceTasks(&coordinator, (reduceBatch > MR_PROCESS_MAX_ITEMS) ? MR_PROCESS_MAX_ITEMS : reduceBatch);
+            continue;
+        }
+        for(unsigned int w = 0; w < coordinator.workerCount; w++){
+            MR_ProcessWorker *worker = &coordinator.workers[w];
+            if(worker->pid < 0 && !MR_SpawnWorker(&coordinator, w)){
+                continue;
+            }
+            while(worker->task < 0 && next < coordinator.taskCount && coordinator.tasks[next].state != MR_TASK_PENDING){
+                next++;
+            }
+            if(worker->task < 0 && next < coordinator.taskCount){
+                MR_AssignTask(&coordinator, w, next);
+            }
+            polls[live].fd = worker->sock;
+            polls[live].events = POLLIN;
+            polled[live++] = w;
+        }
+        if(live == 0){ // cannot start any worker, give up on what is left
+            for(unsigned int t = 0; t < coordinator.taskCount; t++){
+                if(coordinator.tasks[t].state == MR_TASK_PENDING){
+                    coordinator.tasks[t].state = MR_TASK_ABANDONED;
+                }
+            }
+            coordinator.failed = true;
+            fprintf(stderr, "MapReduce: no worker process could be started\n");
+            break;
+        }
+        if(poll(polls, live, -1) < 0){
+            if(errno != EINTR){
+                perror("poll");
+            }
+            continue;
+        }
+        for(unsigned int i = 0; i < live; i++){
+            if(polls[i].revents == 0){
+                continue;
+            }
+            MR_Message message;
+            int fds[MR_PROCESS_MAX_ITEMS];
+            unsigned int fdCount;
+            if(!(polls[i].revents & POLLIN) || !MR_ReceiveMessage(polls[i].fd, &message, fds, &fdCount)){
+                MR_WorkerGone(&coordinator, polled[i]);
+            }
+            else if(!MR_HandleMessage(&coordinator, polled[i], &message, fds, fdCount)){
+                for(unsigned int j = 0; j < fdCount; j++){
+                    close(fds[j]);
+                }
+                MR_WorkerGone(&coordinator, polled[i]);
+            }
+        }
+    }
+    free(polls);
+    free(polled);
+
+    MR_Message exitMessage;
+    memset(&exitMessage, 0, sizeof(exitMessage));
+    exitMessage.type = MR_MESSAGE_EXIT;
+    for(unsigned int w = 0; w < coordinator.workerCount; w++){
+        MR_ProcessWorker *worker = &coordinator.workers[w];
+        if(worker->pid >= 0){
+            MR_SendMessage(worker->sock, &exitMessage, NULL, 0);
+            close(worker->sock);
+            while(waitpid(worker->pid, NULL, 0) < 0 && errno == EINTR){
+            }
+        }
+        MR_CloseShuffleFiles(worker->pending, worker->pendingCount);
+        free(worker->pending);
+    }
+    if(options->partition_stats != NULL){
+        memset(options->partition_stats, 0, sizeof(MR_PartitionStats) * options->num_parts);
+        for(unsigned int f = 0; f < coordinator.fileCount; f++){
+            MR_PartitionStats *stats = &options->partition_stats[coordinator.files[f].partition];
+            stats->records += coordinator.files[f].records;
+            stats->bytes += coordinator.files[f].bytes;
+            stats->slots = 1;
+        }
+    }
+    MR_CloseShuffleFiles(coordinator.files, coordinator.fileCount);
+    free(coordinator.files);
+    free(coordinator.tasks);
+    free(coordinator.workers);
+    free(coordinator.outputSizes);
+    free((void *)coordinator.splits);
+    return !coordinator.failed;
+}
+
+#endif
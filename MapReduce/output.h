@@ -0,0 +1,193 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#define OUTPUT_BUFFER_SIZE (1 << 16)    // Bytes buffered per output file before a write
+
+typedef struct Output {
+    char *path;                         // File appended to, NULL once the output has been closed
+    int fd;                             // -1 until the first write opens the file
+    bool failed;                        // Open or write failed, further output is dropped
+    char *buffer;                       // Allocated on the first write
+    size_t used;
+} Output;
+
+/**
+* Set up a buffered output. The file is only created by the first write, so
+* an output that is never written to leaves no file behind
+* Parameters:
+*     output        - Output to initialise
+*     path          - File to append to
+*/
+void initOutput(Output *output, const char *path){
+    output->path = strdup(path);
+    output->fd = -1;
+    output->failed = false;
+    output->buffer = NULL;
+    output->used = 0;
+}
+
+/**
+* Wrap an already open file, e.g. a temporary file, in a buffered output
+* Parameters:
+*     output        - Output to initialise
+*     fd            - File descriptor open for writing, owned by the output until detachOutput
+*     path          - Name used in error messages
+*/
+void initOutputFd(Output *output, int fd, const char *path){
+    initOutput(output, path);
+    output->fd = fd;
+    output->buffer = (char *)malloc(OUTPUT_BUFFER_SIZE);
+}
+
+/**
+* Write a list of buffers to the output's file, retrying short writes
+* Parameters:
+*     output        - Open output
+*     iov           - Buffers to write, modified as they are consumed
+*     count         - Number of buffers
+*/
+void outputWritev(Output *output, struct iovec *iov, int count){
+    while(count > 0 && !output->failed){
+        ssize_t written = writev(output->fd, iov, count);
+        if(written < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror(output->path);
+            output->failed = true;
+            return;
+        }
+        while(count > 0 && (size_t)written >= iov->iov_len){
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0){
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+bool outputOpen(Output *output){
+    if(output->fd >= 0){
+        return true;
+    }
+    if(output->failed || output->path == NULL){
+        return false;
+    }
+    output->fd = open(output->path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(output->fd < 0){
+        perror(output->path);
+        output->failed = true;
+        return false;
+    }
+    output->buffer = (char *)malloc(OUTPUT_BUFFER_SIZE);
+    return true;
+}
+
+void outputFlush(Output *output){
+    if(output->used > 0 && output->fd >= 0){
+        struct iovec iov = {output->buffer, output->used};
+        outputWritev(output, &iov, 1);
+    }
+    output->used = 0;
+}
+
+/**
+* Append bytes to the output. Small writes are copied into the buffer; a
+* write that does not fit goes out together with the buffered bytes in a
+* single writev
+* Parameters:
+*     output        - Output to write to
+*     data          - Bytes to write
+*     length        - Number of bytes
+*/
+void outputWrite(Output *output, const char *data, size_t length){
+    if(!outputOpen(output)){
+        return;
+    }
+    if(output->used + length <= OUTPUT_BUFFER_SIZE){
+        memcpy(output->buffer + output->used, data, length);
+        output->used += length;
+        return;
+    }
+    struct iovec iov[2] = {{output->buffer, output->used}, {(void *)data, length}};
+    outputWritev(output, iov, 2);
+    output->used = 0;
+}
+
+/**
+* Append formatted text to the output, formatting straight into its buffer
+* Parameters:
+*     output        - Output to write to
+*     format        - printf format
+*     args          - Format arguments
+*/
+void outputVprintf(Output *output, const char *format, va_list args){
+    if(!outputOpen(output)){
+        return;
+    }
+    va_list retry;
+    va_copy(retry, args);
+    size_t space = OUTPUT_BUFFER_SIZE - output->used;
+    int length = vsnprintf(output->buffer + output->used, space, format, args);
+    if(length >= 0 && (size_t)length < space){
+        output->used += length;
+    }
+    else if(length >= 0 && length < OUTPUT_BUFFER_SIZE){ // fits once the buffer is flushed
+        outputFlush(output);
+        output->used = vsnprintf(output->buffer, OUTPUT_BUFFER_SIZE, format, retry);
+    }
+    else if(length >= 0){ // longer than the whole buffer
+        char *text = (char *)malloc(length + 1);
+        vsnprintf(text, length + 1, format, retry);
+        outputWrite(output, text, length);
+        free(text);
+    }
+    va_end(retry);
+}
+
+/**
+* Flush and close the output's file and release its buffer
+* Parameters:
+*     output        - Output to close
+*/
+void closeOutput(Output *output){
+    outputFlush(output);
+    if(output->fd >= 0){
+        close(output->fd);
+        output->fd = -1;
+    }
+    free(output->buffer);
+    output->buffer = NULL;
+    free(output->path);
+    output->path = NULL;
+}
+
+/**
+* Flush the output and release its buffer, leaving the file open for the caller
+* Parameters:
+*     output        - Output set up with initOutputFd
+* Return:
+*     true          - If every write succeeded
+*     false         - Otherwise
+*/
+bool detachOutput(Output *output){
+    outputFlush(output);
+    bool ok = !output->failed;
+    output->fd = -1;
+    closeOutput(output);
+    return ok;
+}
+
+#endif
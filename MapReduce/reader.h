@@ -0,0 +1,173 @@
+#ifndef READER_H
+#define READER_H
+#include "mapreduce.h"
+#include "tokenizer.h"
+#include <stdint.h>
+#include <sys/mman.h>
+
+#ifndef READER_BUFFER_SIZE
+#define READER_BUFFER_SIZE (1 << 20)    // Bytes per read() when the input cannot be mapped
+#endif
+
+typedef struct MR_Reader {
+    MR_Tokenizer tokenizer;             // Delimiter set and vectorized scanner
+    MR_ScanBlock block;                 // Delimiter mask of the bytes under the cursor
+    char *map;                          // Page aligned start of the mapping, NULL when reading into buffer
+    size_t mapLength;
+    int fd;                             // Input file, closed once mapped
+    char *buffer;                       // read() fallback for pipes or files that cannot be mapped
+    size_t capacity;
+    off_t nextOffset;                   // Regular files: offset of the next pread, -1 to read() a stream
+    size_t remaining;                   // Split bytes not read into buffer yet, SIZE_MAX for streams
+    const char *cursor;                 // Next unread byte
+    const char *end;                    // End of the bytes in memory
+} MR_Reader;
+
+/**
+* Open a reader over a split. Regular files are mmap'd with MADV_SEQUENTIAL;
+* pipes and other streams are read to end of file through a large buffer
+* Parameters:
+*     reader        - Reader to initialise
+*     split         - Byte range to read
+*     delimiters    - NUL terminated set of bytes separating tokens, e.g. " \t\n\r"
+* Return:
+*     true          - On success
+*     false         - If the file could not be opened
+*/
+bool MR_ReaderOpen(MR_Reader *reader, const MR_Split *split, const char *delimiters){
+    MR_TokenizerInit(&reader->tokenizer, delimiters);
+    reader->block.start = NULL;
+    reader->map = NULL;
+    reader->mapLength = 0;
+    reader->buffer = NULL;
+    reader->capacity = 0;
+    reader->cursor = NULL;
+    reader->end = NULL;
+    reader->fd = open(split->file_name, O_RDONLY);
+    if(reader->fd < 0){
+        return false;
+    }
+
+    struct stat fileInfo;
+    bool regular = fstat(reader->fd, &fileInfo) == 0 && S_ISREG(fileInfo.st_mode);
+    if(regular && split->length > 0){
+        long page = sysconf(_SC_PAGESIZE);
+        off_t mapOffset = split->offset & ~((off_t)page - 1); // mmap offsets must be page aligned
+        size_t skip = split->offset - mapOffset;
+        void *map = mmap(NULL, split->length + skip, PROT_READ, MAP_PRIVATE, reader->fd, mapOffset);
+        if(map != MAP_FAILED){
+            madvise(map, split->length + skip, MADV_SEQUENTIAL);
+            reader->map = (char *)map;
+            reader->mapLength = split->length + skip;
+            reader->cursor = reader->map + skip;
+            reader->end = reader->cursor + split->length;
+            close(reader->fd);
+            reader->fd = -1;
+            return true;
+        }
+    }
+
+    reader->capacity = READER_BUFFER_SIZE;
+    reader->buffer = (char *)malloc(reader->capacity);
+    reader->cursor = reader->buffer;
+    reader->end = reader->buffer;
+    reader->nextOffset = regular ? split->offset : -1;
+    reader->remaining = regular ? split->length : SIZE_MAX;
+    return true;
+}
+
+/**
+* Read more input into the fallback buffer, keeping the partial token that
+* starts at *start at the front of the buffer
+* Parameters:
+*     reader        - Reader reading through its buffer
+*     start         - Start of the partial token, moved along with it
+* Return:
+*     true          - If more bytes are now available after reader->end's old position
+*     false         - At the end of the split, or if the input is mapped
+*/
+bool MR_ReaderFill(MR_Reader *reader, const char **start){
+    if(reader->buffer == NULL || reader->remaining == 0){
+        return false;
+    }
+    size_t keep = reader->end - *start;
+    memmove(reader->buffer, *start, keep);
+    if(keep == reader->capacity){ // token longer than the buffer
+        reader->capacity *= 2;
+        reader->buffer = (char *)realloc(reader->buffer, reader->capacity);
+    }
+    size_t want = reader->capacity - keep;
+    if(want > reader->remaining){
+        want = reader->remaining;
+    }
+    ssize_t got;
+    if(reader->nextOffset >= 0){
+        got = pread(reader->fd, reader->buffer + keep, want, reader->nextOffset);
+    }
+    else{
+        got = read(reader->fd, reader->buffer + keep, want);
+    }
+    *start = reader->buffer;
+    reader->block.start = NULL; // the bytes moved
+    reader->cursor = reader->buffer + keep;
+    reader->end = reader->cursor;
+    if(got <= 0){
+        reader->remaining = 0;
+        return false;
+    }
+    if(reader->nextOffset >= 0){
+        reader->nextOffset += got;
+        reader->remaining -= got;
+    }
+    reader->end += got;
+    return true;
+}
+
+/**
+* Get the next non-empty token of the split. The view points into the mapping
+* or the reader's buffer and is only valid until the next call
+* Parameters:
+*     reader        - Open reader
+*     token         - Set to the token
+* Return:
+*     true          - If a token was found
+*     false         - At the end of the split
+*/
+bool MR_ReaderNextToken(MR_Reader *reader, MR_Token *token){
+    const MR_Tokenizer *tokenizer = &reader->tokenizer;
+    while(1){
+        reader->cursor = MR_TokenizerScan(tokenizer, &reader->block, reader->cursor, reader->end, true);
+        if(reader->cursor < reader->end){
+            break;
+        }
+        const char *start = reader->end;
+        if(!MR_ReaderFill(reader, &start)){
+            return false;
+        }
+    }
+    const char *start = reader->cursor;
+    while(1){
+        reader->cursor = MR_TokenizerScan(tokenizer, &reader->block, reader->cursor, reader->end, false);
+        if(reader->cursor < reader->end || !MR_ReaderFill(reader, &start)){
+            break; // found a delimiter, or the token runs to the end of the split
+        }
+    }
+    token->data = start;
+    token->length = reader->cursor - start;
+    return true;
+}
+
+void MR_ReaderClose(MR_Reader *reader){
+    if(reader->map != NULL){
+        munmap(reader->map, reader->mapLength);
+        reader->map = NULL;
+    }
+    free(reader->buffer);
+    reader->buffer = NULL;
+    if(reader->fd >= 0){
+        close(reader->fd);
+        reader->fd = -1;
+    }
+}
+
+#endif
@@ -0,0 +1,206 @@
+#ifndef SPILL_H
+#define SPILL_H
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "output.h"
+
+#define SPILL_BUFFER_SIZE (1 << 16)     // Bytes read from a spill file at a time
+
+typedef struct SpillInput {
+    int fd;
+    off_t offset;                       // File offset of the next pread
+    off_t limit;                        // File offset just past the run
+    char *buffer;
+    size_t start;                       // Next unread byte of the buffer
+    size_t end;                         // Bytes in the buffer
+} SpillInput;
+
+/**
+* Create an anonymous temporary file for a spilled run. The file is unlinked
+* right away, so it disappears once its descriptor is closed, even if the
+* process dies
+* Parameters:
+*     dir           - Directory to create the file in
+* Return:
+*     int           - Descriptor open for reading and writing, -1 on failure
+*/
+int spillCreate(const char *dir){
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/mr-spill-XXXXXX", dir);
+    int fd = mkstemp(path);
+    if(fd < 0){
+        perror(path);
+        return -1;
+    }
+    unlink(path);
+    return fd;
+}
+
+/**
+* Raise the soft limit on open descriptors to the hard limit, for jobs that
+* keep one open per spilled run or shuffle file
+*/
+void raiseFileLimit(void){
+    struct rlimit files;
+    if(getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max){
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+}
+
+/**
+* Encode an unsigned LEB128 varint
+* Parameters:
+*     bytes         - At least 10 bytes of room
+*     value         - Value to encode
+* Return:
+*     size_t        - Bytes written
+*/
+size_t varintEncode(char *bytes, uint64_t value){
+    size_t length = 0;
+    while(value >= 0x80){
+        bytes[length++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    bytes[length++] = (char)value;
+    return length;
+}
+
+/**
+* Decode an unsigned LEB128 varint that fills a whole byte string
+* Parameters:
+*     bytes         - Encoded varint
+*     length        - Bytes in the encoding
+*     value         - Set to the decoded value
+* Return:
+*     true          - If the bytes hold exactly one varint
+*     false         - Otherwise
+*/
+bool varintDecode(const char *bytes, size_t length, uint64_t *value){
+    *value = 0;
+    for(size_t i = 0; i < length && i < 10; i++){
+        unsigned char byte = (unsigned char)bytes[i];
+        *value |= (uint64_t)(byte & 0x7F) << (7 * i);
+        if(byte < 0x80){
+            return i + 1 == length;
+        }
+    }
+    return false;
+}
+
+/**
+* Append an unsigned LEB128 varint
+* Parameters:
+*     output        - Spill file being written
+*     value         - Value to encode
+*/
+void spillWriteVarint(Output *output, uint64_t value){
+    char bytes[10];
+    outputWrite(output, bytes, varintEncode(bytes, value));
+}
+
+/**
+* Set up reading of a run stored in part of a file
+* Parameters:
+*     input         - Input to initialise
+*     fd            - File holding the run
+*     offset        - File offset of the run's first byte
+*     length        - Bytes in the run
+*/
+void initSpillInput(SpillInput *input, int fd, off_t offset, size_t length){
+    input->fd = fd;
+    input->offset = offset;
+    input->limit = offset + (off_t)length;
+    input->buffer = (char *)malloc(SPILL_BUFFER_SIZE);
+    input->start = 0;
+    input->end = 0;
+}
+
+void destroySpillInput(SpillInput *input){
+    free(input->buffer);
+    input->buffer = NULL;
+}
+
+/**
+* Read more of the run into the input's buffer
+* Return:
+*     true          - If bytes were read
+*     false         - At the end of the run or on error
+*/
+bool spillFill(SpillInput *input){
+    size_t want = (input->limit - input->offset < SPILL_BUFFER_SIZE) ? (size_t)(input->limit - input->offset) : SPILL_BUFFER_SIZE;
+    if(want == 0){
+        return false;
+    }
+    ssize_t got;
+    do{
+        got = pread(input->fd, input->buffer, want, input->offset);
+    }while(got < 0 && errno == EINTR);
+    if(got < 0){
+        perror("spill read");
+    }
+    if(got <= 0){
+        return false;
+    }
+    input->offset += got;
+    input->start = 0;
+    input->end = got;
+    return true;
+}
+
+/**
+* Copy the next bytes of a spill file
+* Parameters:
+*     input         - Spill file being read
+*     destination   - Where to copy the bytes
+*     length        - Number of bytes
+* Return:
+*     true          - On success
+*     false         - If the file ended first
+*/
+bool spillRead(SpillInput *input, void *destination, size_t length){
+    char *to = (char *)destination;
+    while(length > 0){
+        if(input->start == input->end && !spillFill(input)){
+            return false;
+        }
+        size_t chunk = input->end - input->start;
+        if(chunk > length){
+            chunk = length;
+        }
+        memcpy(to, input->buffer + input->start, chunk);
+        input->start += chunk;
+        to += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+/**
+* Bytes of the run not handed out yet, buffered or still in the file
+*/
+uint64_t spillRemaining(const SpillInput *input){
+    return (uint64_t)(input->limit - input->offset) + (input->end - input->start);
+}
+
+bool spillReadVarint(SpillInput *input, uint64_t *value){
+    *value = 0;
+    for(int shift = 0; shift < 64; shift += 7){
+        if(input->start == input->end && !spillFill(input)){
+            return false;
+        }
+        unsigned char byte = (unsigned char)input->buffer[input->start++];
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if(byte < 0x80){
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
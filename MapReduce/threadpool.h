@@ -3,51 +3,487 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
-#include <sys/stat.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #define DEBUG false
 typedef void (*thread_func_t)(void *arg);
 
+typedef enum {
+    JOB_GENERIC,                     // Any other work queued on the pool
+    JOB_MAP,                         // MapReduce map task, sized by its input split
+    JOB_REDUCE                       // MapReduce reduce task, sized by its partition
+} ThreadPool_job_kind_t;
+
 typedef struct ThreadPool_job_t {
     thread_func_t func;              // function pointer
     void *arg;                       // arguments for that function
     struct ThreadPool_job_t *next;   // pointer to the next job in the queue
     size_t jobSize;                 // Holds the size (estimated time) for a file 
+    ThreadPool_job_kind_t kind;      // What the job is, given by the submitter
+    unsigned long seq;               // Submission order, breaks jobSize ties first come first served
 } ThreadPool_job_t;
 
+#define JOB_HEAP_INITIAL_CAPACITY 64 // Slots in a fresh SJF heap
+
 typedef struct {
-    unsigned int size;               // no. jobs in the queue
-    ThreadPool_job_t *head;          // pointer to the first (shortest) job
-    // add other members if needed
+    ThreadPool_job_t **heap;         // min-heap on (jobSize, seq), heap[0] is the shortest job
+    unsigned int count;              // no. jobs in the heap
+    unsigned int capacity;           // Slots allocated for the heap
+    unsigned long nextSeq;           // Sequence number of the next queued job
 } ThreadPool_job_queue_t;
 
+typedef enum {
+    THREADPOOL_SJF,                  // One shared queue ordered shortest job first
+    THREADPOOL_WORK_STEALING         // Per worker deques, idle workers steal from random victims
+} ThreadPool_kind_t;
+
 typedef struct {
+    unsigned int state;              // Outstanding count times two, bit 0 set once a thread may be sleeping on it
+} ThreadPool_latch_t;
+
+typedef enum {
+    THREADPOOL_AFFINITY_NONE,        // Workers are not pinned, the kernel moves them freely
+    THREADPOOL_AFFINITY_COMPACT,     // Pin worker i to the i-th allowed CPU, filling a NUMA node before the next
+    THREADPOOL_AFFINITY_SPREAD       // Pin workers round robin across NUMA nodes, then across each node's CPUs
+} ThreadPool_affinity_t;
+
+#define THREADPOOL_MAX_CPUS 1024     // CPUs a placement can use, as in glibc's cpu_set_t
+#define THREADPOOL_MAX_NODES 64      // NUMA nodes a placement can tell apart
+#define THREADPOOL_MASK_BITS (8 * sizeof(unsigned long))
+#define THREADPOOL_MASK_WORDS (THREADPOOL_MAX_CPUS / THREADPOOL_MASK_BITS)
+
+#define DEQUE_INITIAL_CAPACITY 64    // Slots in a fresh work stealing deque (power of two)
+
+typedef struct ThreadPool_deque_array_t {
+    long capacity;                   // Always a power of two
+    struct ThreadPool_deque_array_t *retired; // Smaller array this one replaced, freed with the deque
+    ThreadPool_job_t *slots[];
+} ThreadPool_deque_array_t;
+
+typedef struct {
+    long top;                        // Next index thieves steal from
+    long bottom;                     // Next index the owner pushes to
+    ThreadPool_deque_array_t *array; // Circular buffer, replaced (never shrunk) when full
+} ThreadPool_deque_t;
+
+struct ThreadPool_t;
+
+typedef struct {
+    uint64_t jobs;                   // Jobs run
+    uint64_t busyNs;                 // Time spent inside jobs
+    uint64_t idleNs;                 // Time spent asleep waiting for a job
+    uint64_t lockWaitNs;             // Time spent blocked on the pool lock or an inbox lock
+    uint64_t steals;                 // Work stealing only: jobs taken from another worker
+} ThreadPool_metrics_t;
+
+typedef struct {
+    uint64_t start;                  // Nanoseconds since the pool was created
+    uint64_t duration;
+    size_t jobSize;
+    ThreadPool_job_kind_t kind;
+} ThreadPool_span_t;
+
+typedef struct {
+    struct ThreadPool_t *pool;       // Pool the worker belongs to
+    unsigned int id;                 // Index of the worker in the pool
+    unsigned int seed;               // State of the victim picking xorshift
+    ThreadPool_deque_t deque;        // Chase-Lev deque, only the owner pushes and pops
+    pthread_mutex_t inboxLock;       // Guards jobs submitted from threads outside the pool
+    ThreadPool_job_t *inbox;
+    int cpu;                         // CPU the worker pins itself to, -1 if it is not pinned
+    int node;                        // NUMA node of that CPU, -1 if unknown
+    ThreadPool_metrics_t metrics;    // Only written by the worker's thread
+    ThreadPool_span_t *spans;        // One per job run while the pool is tracing
+    size_t spanCount;
+    size_t spanCapacity;
+} ThreadPool_worker_t;
+
+typedef struct ThreadPool_t {
     pthread_t *threads;              // pointer to the array of thread handles
     ThreadPool_job_queue_t jobs;     // queue of jobs waiting for a thread to run
     int num_workers;                 // Number of threads in the pool
     int shutdown;                    // Is the pool Shutting down?
     pthread_mutex_t lock;            // Mutex Lock
     pthread_cond_t isWorkToDo;       // Condition variable to isWorkToDo threads
-    pthread_cond_t isIdle;           // Condition variable to notify when a thread is entering idle state
     pthread_cond_t isFull;           // Condition variable to notifiy when threads are full 
+    ThreadPool_kind_t kind;          // Scheduler picked at creation
+    ThreadPool_worker_t *workers;    // One per thread, deques and inboxes are only used by work stealing
+    unsigned int nextInbox;          // Work stealing only: round robin target for outside submissions
+    unsigned int sleepers;           // Work stealing only: workers waiting on isWorkToDo
+    ThreadPool_latch_t pending;      // Jobs queued or running, ThreadPool_check waits for it to open
+    uint64_t startNs;                // Creation time, origin of the trace timestamps
+    bool tracing;                    // Record a span for every job run
 } ThreadPool_t;
 
 typedef struct ThreadArgs {
     unsigned int partId;                                     // Partition ID
     void (*reducer)(char *key, unsigned int partition_idx);  // Function pointer to the reducer
     size_t size;                                             // Bucket size
+    void *job;                                               // MR_Job the partition belongs to
 } ThreadArgs;
 
-void *Thread_run(ThreadPool_t *tp);
+__thread ThreadPool_worker_t *currentWorker = NULL; // Worker running on this thread, if any
+
+uint64_t ThreadPool_now(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
 /**
-* C style constructor for creating a new ThreadPool object
+* Add to one of the calling worker's counters. Only the owner writes them, so
+* a relaxed load and store is enough and other threads may read them at any time
 * Parameters:
-*     num - Number of threads to create
+*     counter - Counter in the worker's metrics
+*     amount  - Amount to add
+*/
+void ThreadPool_metric_add(uint64_t *counter, uint64_t amount){
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+/**
+* Lock a pool mutex. The uncontended case is a single trylock; only a lock
+* that is already held is timed and charged to the calling worker
+* Parameters:
+*     lock - Mutex to lock
+*/
+void ThreadPool_lock(pthread_mutex_t *lock){
+    if(pthread_mutex_trylock(lock) == 0){
+        return;
+    }
+    uint64_t start = ThreadPool_now();
+    pthread_mutex_lock(lock);
+    if(currentWorker != NULL){
+        ThreadPool_metric_add(&currentWorker->metrics.lockWaitNs, ThreadPool_now() - start);
+    }
+}
+
+/**
+* Set a latch's count. A latch opens when its count drops to zero
+* Parameters:
+*     latch - Latch to initialise
+*     count - Number of count downs it waits for
+*/
+void ThreadPool_latch_init(ThreadPool_latch_t *latch, unsigned int count){
+    latch->state = count << 1;
+}
+
+/**
+* Raise a latch's count, e.g. for jobs submitted after it was set up. Must
+* happen before the matching work is published to other threads
+* Parameters:
+*     latch - Latch to raise
+*     count - Extra count downs to wait for
+*/
+void ThreadPool_latch_add(ThreadPool_latch_t *latch, unsigned int count){
+    __atomic_add_fetch(&latch->state, count << 1, __ATOMIC_RELAXED);
+}
+
+unsigned int ThreadPool_latch_count(ThreadPool_latch_t *latch){
+    return __atomic_load_n(&latch->state, __ATOMIC_RELAXED) >> 1;
+}
+
+/**
+* Count a latch down by one. Only the count down that opens the latch makes
+* a system call, and only if a waiter marked itself. The latch is not read
+* after the decrement, so a waiter may free it as soon as it sees it open;
+* a wake on freed memory at worst wakes an unrelated futex spuriously
+* Parameters:
+*     latch - Latch to count down
+* Return:
+*     true  - If this count down opened the latch
+*     false - Otherwise
+*/
+bool ThreadPool_latch_count_down(ThreadPool_latch_t *latch){
+    unsigned int old = __atomic_fetch_sub(&latch->state, 2, __ATOMIC_ACQ_REL);
+    if((old >> 1) != 1){
+        return false;
+    }
+    if(old & 1){
+        syscall(SYS_futex, &latch->state, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+    return true;
+}
+
+/**
+* Sleep on a futex until a latch opens. Returns at once, without a system
+* call, if it is already open
+* Parameters:
+*     latch - Latch to wait for
+*/
+void ThreadPool_latch_wait(ThreadPool_latch_t *latch){
+    unsigned int state = __atomic_load_n(&latch->state, __ATOMIC_ACQUIRE);
+    while((state >> 1) != 0){
+        // Mark a waiter so the opening count down knows to wake us
+        if(!(state & 1) && !__atomic_compare_exchange_n(&latch->state, &state, state | 1, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)){
+            continue;
+        }
+        syscall(SYS_futex, &latch->state, FUTEX_WAIT_PRIVATE, state | 1, NULL, NULL, 0);
+        state = __atomic_load_n(&latch->state, __ATOMIC_ACQUIRE);
+    }
+    // Clear the mark so the next time the count drops to zero no wake is made, unless it was raised again
+    __atomic_compare_exchange_n(&latch->state, &state, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+void ThreadPool_deque_init(ThreadPool_deque_t *deque){
+    deque->top = 0;
+    deque->bottom = 0;
+    deque->array = (ThreadPool_deque_array_t *)malloc(sizeof(ThreadPool_deque_array_t) + DEQUE_INITIAL_CAPACITY * sizeof(ThreadPool_job_t *));
+    deque->array->capacity = DEQUE_INITIAL_CAPACITY;
+    deque->array->retired = NULL;
+}
+
+void ThreadPool_deque_destroy(ThreadPool_deque_t *deque){
+    ThreadPool_deque_array_t *array = deque->array;
+    while(array != NULL){
+        ThreadPool_deque_array_t *retired = array->retired;
+        free(array);
+        array = retired;
+    }
+    deque->array = NULL;
+}
+
+/**
+* Push a job to the bottom of a Chase-Lev deque, growing it when full.
+* Only the owning worker may call this
+* Parameters:
+*     deque - Deque of the calling worker
+*     job   - Job to push
+*/
+void ThreadPool_deque_push(ThreadPool_deque_t *deque, ThreadPool_job_t *job){
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    ThreadPool_deque_array_t *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+    if(bottom - top > array->capacity - 1){
+        // Thieves may still be reading the old array, keep it until the deque is destroyed
+        ThreadPool_deque_array_t *grown = (ThreadPool_deque_array_t *)malloc(sizeof(ThreadPool_deque_array_t) + 2 * array->capacity * sizeof(ThreadPool_job_t *));
+        grown->capacity = 2 * array->capacity;
+        grown->retired = array;
+        for(long i = top; i < bottom; i++){
+            grown->slots[i & (grown->capacity - 1)] = array->slots[i & (array->capacity - 1)];
+        }
+        __atomic_store_n(&deque->array, grown, __ATOMIC_RELEASE);
+        array = grown;
+    }
+    __atomic_store_n(&array->slots[bottom & (array->capacity - 1)], job, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE); // publishes the slot and the job
+}
+
+/**
+* Pop the most recently pushed job from the bottom of a Chase-Lev deque.
+* Only the owning worker may call this
+* Parameters:
+*     deque - Deque of the calling worker
+* Return:
+*     ThreadPool_job_t* - Job, NULL if the deque is empty
+*/
+ThreadPool_job_t *ThreadPool_deque_pop(ThreadPool_deque_t *deque){
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    ThreadPool_deque_array_t *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+    // Sequentially consistent so that thieves and the owner agree on who sees the last job
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+    ThreadPool_job_t *job = NULL;
+    if(top <= bottom){
+        job = __atomic_load_n(&array->slots[bottom & (array->capacity - 1)], __ATOMIC_RELAXED);
+        if(top == bottom){ // last job, race the thieves for it
+            if(!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
+                job = NULL;
+            }
+            __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        }
+    }
+    else{ // empty
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return job;
+}
+
+/**
+* Steal the oldest job from the top of another worker's deque
+* Parameters:
+*     deque - Victim's deque
+* Return:
+*     ThreadPool_job_t* - Job, NULL if the deque was empty or another thread won the race
+*/
+ThreadPool_job_t *ThreadPool_deque_steal(ThreadPool_deque_t *deque){
+    long top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST);
+    if(top >= bottom){
+        return NULL;
+    }
+    ThreadPool_deque_array_t *array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+    ThreadPool_job_t *job = __atomic_load_n(&array->slots[top & (array->capacity - 1)], __ATOMIC_RELAXED);
+    if(!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
+        return NULL;
+    }
+    return job;
+}
+
+bool ThreadPool_cpu_isset(const unsigned long *mask, int cpu){
+    return (mask[cpu / THREADPOOL_MASK_BITS] >> (cpu % THREADPOOL_MASK_BITS)) & 1;
+}
+
+void ThreadPool_cpu_set(unsigned long *mask, int cpu){
+    mask[cpu / THREADPOOL_MASK_BITS] |= 1UL << (cpu % THREADPOOL_MASK_BITS);
+}
+
+/**
+* Read a sysfs CPU or node list such as "0-3,8-11" into a bit mask
+* Parameters:
+*     path - File holding the list
+*     mask - THREADPOOL_MASK_WORDS words, bits are only ever set
+* Return:
+*     true  - If the file could be read and parsed
+*     false - Otherwise
+*/
+bool ThreadPool_read_cpulist(const char *path, unsigned long *mask){
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL){
+        return false;
+    }
+    char text[8192];
+    bool ok = fgets(text, sizeof(text), fp) != NULL;
+    fclose(fp);
+    for(char *p = text; ok && *p != '\0' && *p != '\n';){
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if(end == p || first < 0){
+            return false;
+        }
+        if(*end == '-'){
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if(end == p || last < first){
+                return false;
+            }
+        }
+        for(long cpu = first; cpu <= last && cpu < THREADPOOL_MAX_CPUS; cpu++){
+            ThreadPool_cpu_set(mask, (int)cpu);
+        }
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return ok;
+}
+
+/**
+* Pick a CPU and NUMA node for every worker. The candidates are the CPUs the
+* process may run on, e.g. as restricted by numactl or taskset, grouped by
+* the node sysfs puts them in; CPUs of no known node form one group of their
+* own. Leaves every worker unpinned if the allowed CPUs cannot be read
+* Parameters:
+*     tp       - Pool whose workers are being set up
+*     affinity - Placement policy
+*/
+void ThreadPool_place_workers(ThreadPool_t *tp, ThreadPool_affinity_t affinity){
+    for(int i = 0; i < tp->num_workers; i++){
+        tp->workers[i].cpu = -1;
+        tp->workers[i].node = -1;
+    }
+    unsigned long allowed[THREADPOOL_MASK_WORDS] = {0}, online[THREADPOOL_MASK_WORDS] = {0}, seen[THREADPOOL_MASK_WORDS] = {0};
+    if(affinity == THREADPOOL_AFFINITY_NONE || syscall(SYS_sched_getaffinity, 0, sizeof(allowed), allowed) < 0){
+        return;
+    }
+    int cpus[THREADPOOL_MAX_CPUS];   // allowed CPUs, grouped by node
+    int groupFirst[THREADPOOL_MAX_NODES + 1], groupSize[THREADPOOL_MAX_NODES + 1], groupNode[THREADPOOL_MAX_NODES + 1];
+    int count = 0, groups = 0;
+    if(ThreadPool_read_cpulist("/sys/devices/system/node/online", online)){
+        for(int node = 0; node < THREADPOOL_MAX_CPUS && groups < THREADPOOL_MAX_NODES; node++){
+            unsigned long nodeCpus[THREADPOOL_MASK_WORDS] = {0};
+            char path[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+            if(!ThreadPool_cpu_isset(online, node) || !ThreadPool_read_cpulist(path, nodeCpus)){
+                continue;
+            }
+            groupFirst[groups] = count;
+            for(int cpu = 0; cpu < THREADPOOL_MAX_CPUS; cpu++){
+                if(ThreadPool_cpu_isset(nodeCpus, cpu) && ThreadPool_cpu_isset(allowed, cpu) && !ThreadPool_cpu_isset(seen, cpu)){
+                    ThreadPool_cpu_set(seen, cpu);
+                    cpus[count++] = cpu;
+                }
+            }
+            groupSize[groups] = count - groupFirst[groups];
+            groupNode[groups] = node;
+            if(groupSize[groups] > 0){ // memory only nodes have no CPUs to offer
+                groups++;
+            }
+        }
+    }
+    groupFirst[groups] = count;
+    for(int cpu = 0; cpu < THREADPOOL_MAX_CPUS; cpu++){
+        if(ThreadPool_cpu_isset(allowed, cpu) && !ThreadPool_cpu_isset(seen, cpu)){
+            cpus[count++] = cpu;
+        }
+    }
+    groupSize[groups] = count - groupFirst[groups];
+    groupNode[groups] = -1;
+    if(groupSize[groups] > 0){
+        groups++;
+    }
+    if(count == 0){
+        return;
+    }
+    for(int i = 0; i < tp->num_workers; i++){
+        int group, index;
+        if(affinity == THREADPOOL_AFFINITY_SPREAD){
+            group = i % groups;
+            index = groupFirst[group] + (i / groups) % groupSize[group];
+        }
+        else{ // compact: more workers than CPUs wrap around to the first node
+            index = i % count;
+            for(group = 0; index >= groupFirst[group] + groupSize[group]; group++);
+        }
+        tp->workers[i].cpu = cpus[index];
+        tp->workers[i].node = groupNode[group];
+    }
+}
+
+/**
+* Pin the calling worker's thread to its CPU. Called by the worker itself
+* before it runs any job, so every page it first touches from then on
+* (emit buffers, runs, output buffers) is placed on its node and stays local
+* Parameters:
+*     worker - Worker owning the calling thread
+*/
+void ThreadPool_pin(ThreadPool_worker_t *worker){
+    if(worker->cpu < 0){
+        return;
+    }
+    unsigned long mask[THREADPOOL_MASK_WORDS] = {0};
+    ThreadPool_cpu_set(mask, worker->cpu);
+    if(syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) != 0){
+        perror("sched_setaffinity"); // the worker keeps running unpinned
+    }
+}
+
+/**
+* NUMA node of the worker running on the calling thread
+* Return:
+*     int - Node, -1 outside a pool or for a worker that is not pinned
+*/
+int ThreadPool_current_node(void){
+    return (currentWorker != NULL) ? currentWorker->node : -1;
+}
+
+void *Thread_run(ThreadPool_worker_t *worker);
+void *Thread_run_stealing(ThreadPool_worker_t *worker);
+/**
+* C style constructor for creating a new ThreadPool object with a given
+* scheduler and worker placement
+* Parameters:
+*     num      - Number of threads to create
+*     kind     - THREADPOOL_SJF or THREADPOOL_WORK_STEALING
+*     affinity - THREADPOOL_AFFINITY_NONE, _COMPACT or _SPREAD
 * Return:
 *     ThreadPool_t* - Pointer to the newly created ThreadPool object
 */
-ThreadPool_t *ThreadPool_create(unsigned int num){
+ThreadPool_t *ThreadPool_create_affinity(unsigned int num, ThreadPool_kind_t kind, ThreadPool_affinity_t affinity){
     ThreadPool_t *pool = (ThreadPool_t *)malloc(sizeof(ThreadPool_t));
     if (pool == NULL) {
         return NULL; // check for failure 
@@ -60,22 +496,237 @@ ThreadPool_t *ThreadPool_create(unsigned int num){
     }
     pool->num_workers = num;
     pool->shutdown = 0;
-    
-    pool->jobs.size=0; 
-    pool->jobs.head = NULL;
+    pool->kind = kind;
+    pool->workers = NULL;
+    pool->nextInbox = 0;
+    pool->sleepers = 0;
+    ThreadPool_latch_init(&pool->pending, 0);
+    pool->startNs = ThreadPool_now();
+    pool->tracing = false;
+    pool->jobs.heap = (ThreadPool_job_t **)malloc(sizeof(ThreadPool_job_t *) * JOB_HEAP_INITIAL_CAPACITY);
+    pool->jobs.count = 0;
+    pool->jobs.capacity = JOB_HEAP_INITIAL_CAPACITY;
+    pool->jobs.nextSeq = 0;
     
     //init sync variables
     pthread_mutex_init(&pool->lock, NULL);
     pthread_cond_init(&pool->isWorkToDo, NULL);
     pthread_cond_init(&pool->isFull, NULL);
-    pthread_cond_init(&pool->isIdle, NULL);
-    for(unsigned int i = 0; i <num; i++){
-        pthread_create(&pool->threads[i], NULL, (void *(*)(void *))Thread_run, (void*) pool);
+    pool->workers = (ThreadPool_worker_t *)calloc(num, sizeof(ThreadPool_worker_t)); // zeroed metrics and spans
+    for(unsigned int i = 0; i < num; i++){
+        ThreadPool_worker_t *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->id = i;
+        worker->seed = 2654435761u * (i + 1);
+        ThreadPool_deque_init(&worker->deque);
+        pthread_mutex_init(&worker->inboxLock, NULL);
+        worker->inbox = NULL;
+    }
+    ThreadPool_place_workers(pool, affinity);
+    void *(*start)(void *) = (kind == THREADPOOL_WORK_STEALING) ? (void *(*)(void *))Thread_run_stealing : (void *(*)(void *))Thread_run;
+    for(unsigned int i = 0; i < num; i++){
+        pthread_create(&pool->threads[i], NULL, start, (void*) &pool->workers[i]);
     }
 
     return pool;
 }
 
+/**
+* C style constructor for creating a new ThreadPool object with a given scheduler
+* and unpinned workers
+* Parameters:
+*     num  - Number of threads to create
+*     kind - THREADPOOL_SJF or THREADPOOL_WORK_STEALING
+* Return:
+*     ThreadPool_t* - Pointer to the newly created ThreadPool object
+*/
+ThreadPool_t *ThreadPool_create_kind(unsigned int num, ThreadPool_kind_t kind){
+    return ThreadPool_create_affinity(num, kind, THREADPOOL_AFFINITY_NONE);
+}
+
+/**
+* C style constructor for creating a new shortest job first ThreadPool object
+* Parameters:
+*     num - Number of threads to create
+* Return:
+*     ThreadPool_t* - Pointer to the newly created ThreadPool object
+*/
+ThreadPool_t *ThreadPool_create(unsigned int num){
+    return ThreadPool_create_kind(num, THREADPOOL_SJF);
+}
+
+/**
+* Queue a job on a work stealing pool. Workers push to their own deque,
+* other threads spread jobs round robin over the workers' inboxes
+* Parameters:
+*     tp   - Pointer to a THREADPOOL_WORK_STEALING ThreadPool object
+*     task - Job to queue
+*/
+void ThreadPool_add_job_stealing(ThreadPool_t *tp, ThreadPool_job_t *task){
+    ThreadPool_latch_add(&tp->pending, 1); // counts queued and running jobs
+    if(currentWorker != NULL && currentWorker->pool == tp){
+        ThreadPool_deque_push(&currentWorker->deque, task);
+    }
+    else{
+        unsigned int target = __atomic_fetch_add(&tp->nextInbox, 1, __ATOMIC_RELAXED) % tp->num_workers;
+        ThreadPool_worker_t *worker = &tp->workers[target];
+        ThreadPool_lock(&worker->inboxLock);
+        task->next = worker->inbox;
+        __atomic_store_n(&worker->inbox, task, __ATOMIC_RELAXED); // peeked at by thieves without the lock
+        pthread_mutex_unlock(&worker->inboxLock);
+    }
+    // Read-modify-write so either we see a registering sleeper or its re-scan sees the job
+    if(__atomic_fetch_add(&tp->sleepers, 0, __ATOMIC_SEQ_CST) > 0){
+        ThreadPool_lock(&tp->lock);
+        pthread_cond_signal(&tp->isWorkToDo);
+        pthread_mutex_unlock(&tp->lock);
+    }
+}
+
+/**
+* Find a job for a work stealing worker: its own deque first, then its inbox,
+* then the deques and inboxes of the other workers starting at a random victim
+* Parameters:
+*     worker - Calling worker
+* Return:
+*     ThreadPool_job_t* - Next job to run, NULL if none was found
+*/
+ThreadPool_job_t *ThreadPool_get_job_stealing(ThreadPool_worker_t *worker){
+    ThreadPool_t *tp = worker->pool;
+    ThreadPool_job_t *task = ThreadPool_deque_pop(&worker->deque);
+    if(task != NULL){
+        return task;
+    }
+    ThreadPool_lock(&worker->inboxLock);
+    ThreadPool_job_t *inbox = worker->inbox;
+    __atomic_store_n(&worker->inbox, NULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&worker->inboxLock);
+    if(inbox != NULL){ // keep the first job, publish the rest for thieves
+        task = inbox;
+        for(ThreadPool_job_t *job = inbox->next; job != NULL;){
+            ThreadPool_job_t *next = job->next;
+            ThreadPool_deque_push(&worker->deque, job);
+            job = next;
+        }
+        return task;
+    }
+
+    worker->seed ^= worker->seed << 13; // xorshift32
+    worker->seed ^= worker->seed >> 17;
+    worker->seed ^= worker->seed << 5;
+    unsigned int start = worker->seed % tp->num_workers;
+    for(int i = 0; i < tp->num_workers; i++){
+        ThreadPool_worker_t *victim = &tp->workers[(start + i) % tp->num_workers];
+        if(victim == worker){
+            continue;
+        }
+        task = ThreadPool_deque_steal(&victim->deque);
+        if(task != NULL){
+            ThreadPool_metric_add(&worker->metrics.steals, 1);
+            return task;
+        }
+        if(__atomic_load_n(&victim->inbox, __ATOMIC_RELAXED) != NULL && pthread_mutex_trylock(&victim->inboxLock) == 0){
+            task = victim->inbox;
+            if(task != NULL){
+                __atomic_store_n(&victim->inbox, task->next, __ATOMIC_RELAXED);
+            }
+            pthread_mutex_unlock(&victim->inboxLock);
+            if(task != NULL){
+                ThreadPool_metric_add(&worker->metrics.steals, 1);
+                return task;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+* Append a job's span to the worker's trace, growing it when full
+* Parameters:
+*     worker - Worker that ran the job
+*     task   - Job that ran
+*     start  - When the job started
+*     end    - When it returned
+*/
+void ThreadPool_record_span(ThreadPool_worker_t *worker, ThreadPool_job_t *task, uint64_t start, uint64_t end){
+    if(worker->spanCount == worker->spanCapacity){
+        size_t capacity = (worker->spanCapacity > 0) ? 2 * worker->spanCapacity : 256;
+        ThreadPool_span_t *spans = (ThreadPool_span_t *)realloc(worker->spans, sizeof(ThreadPool_span_t) * capacity);
+        if(spans == NULL){
+            return; // drop the span rather than the job
+        }
+        worker->spans = spans;
+        worker->spanCapacity = capacity;
+    }
+    ThreadPool_span_t *span = &worker->spans[worker->spanCount++];
+    span->start = start - worker->pool->startNs;
+    span->duration = end - start;
+    span->jobSize = task->jobSize;
+    span->kind = task->kind;
+}
+
+/**
+* Run a job on a worker, account its time and release it. The pool's pending
+* latch is counted down last, so the job's metrics and span are visible to
+* any thread ThreadPool_check lets through
+* Parameters:
+*     worker - Calling worker
+*     task   - Job to run, freed here
+*/
+void ThreadPool_run_job(ThreadPool_worker_t *worker, ThreadPool_job_t *task){
+    ThreadPool_t *tp = worker->pool;
+    uint64_t start = ThreadPool_now();
+    task->func(task->arg);
+    uint64_t end = ThreadPool_now();
+    ThreadPool_metric_add(&worker->metrics.jobs, 1);
+    ThreadPool_metric_add(&worker->metrics.busyNs, end - start);
+    if(__atomic_load_n(&tp->tracing, __ATOMIC_RELAXED)){
+        ThreadPool_record_span(worker, task, start, end);
+    }
+    free(task);
+    ThreadPool_latch_count_down(&tp->pending);
+}
+
+/**
+* Start routine of each thread in a work stealing ThreadPool object.
+* Runs jobs until the pool shuts down, sleeping on isWorkToDo when no job
+* can be found anywhere in the pool
+* Parameters:
+*     worker - Worker owning this thread
+*/
+void *Thread_run_stealing(ThreadPool_worker_t *worker){
+    ThreadPool_t *tp = worker->pool;
+    currentWorker = worker;
+    ThreadPool_pin(worker);
+    while(1){
+        ThreadPool_job_t *task = ThreadPool_get_job_stealing(worker);
+        if(task == NULL){
+            ThreadPool_lock(&tp->lock);
+            __atomic_add_fetch(&tp->sleepers, 1, __ATOMIC_SEQ_CST);
+            // Re-scan with the sleeper registered: a job added from now on will signal us
+            task = ThreadPool_get_job_stealing(worker);
+            if(task == NULL && !tp->shutdown){
+                uint64_t start = ThreadPool_now();
+                pthread_cond_wait(&tp->isWorkToDo, &tp->lock);
+                ThreadPool_metric_add(&worker->metrics.idleNs, ThreadPool_now() - start);
+            }
+            __atomic_sub_fetch(&tp->sleepers, 1, __ATOMIC_SEQ_CST);
+            int shutdown = tp->shutdown;
+            pthread_mutex_unlock(&tp->lock);
+            if(task == NULL){
+                if(shutdown){
+                    break;
+                }
+                continue;
+            }
+        }
+
+        ThreadPool_run_job(worker, task);
+    }
+    currentWorker = NULL;
+    return NULL;
+}
+
 /**
 * C style destructor to destroy a ThreadPool object
 * Parameters:
@@ -91,10 +742,16 @@ void ThreadPool_destroy(ThreadPool_t *tp){
     // Join all worker threads
     for (int i = 0; i < tp->num_workers; i++) {
         pthread_join(tp->threads[i], NULL);
-        pthread_cond_signal(&tp->isIdle);
     }
 
     free(tp->threads);
+    free(tp->jobs.heap);
+    for(int i = 0; i < tp->num_workers; i++){
+        ThreadPool_deque_destroy(&tp->workers[i].deque);
+        pthread_mutex_destroy(&tp->workers[i].inboxLock);
+        free(tp->workers[i].spans);
+    }
+    free(tp->workers);
     pthread_mutex_destroy(&tp->lock);
     pthread_cond_destroy(&tp->isWorkToDo);
     pthread_cond_destroy(&tp->isFull);
@@ -102,7 +759,130 @@ void ThreadPool_destroy(ThreadPool_t *tp){
 }
 
 /**
-* Add a job to the ThreadPool's job queue
+* Wrap a function and its argument in a job
+* Parameters:
+*     func    - Pointer to the function that will be called by the serving thread
+*     arg     - Arguments for that function
+*     jobSize - Cost estimate, SJF pools run smaller jobs first
+*     kind    - What the job is
+* Return:
+*     ThreadPool_job_t* - New job, owned by the pool once queued
+*/
+ThreadPool_job_t *ThreadPool_new_job(thread_func_t func, void *arg, size_t jobSize, ThreadPool_job_kind_t kind){
+    ThreadPool_job_t *task = (ThreadPool_job_t*)malloc(sizeof(ThreadPool_job_t));
+    task->next = NULL;
+    task->func = func;
+    task->arg = arg;
+    task->jobSize = jobSize;
+    task->kind = kind;
+    task->seq = 0;
+    return task;
+}
+
+bool ThreadPool_job_before(ThreadPool_job_t *a, ThreadPool_job_t *b){
+    return a->jobSize < b->jobSize || (a->jobSize == b->jobSize && a->seq < b->seq);
+}
+
+void ThreadPool_heap_sift_up(ThreadPool_job_queue_t *jobs, unsigned int i){
+    ThreadPool_job_t *task = jobs->heap[i];
+    while(i > 0){
+        unsigned int parent = (i - 1) / 2;
+        if(!ThreadPool_job_before(task, jobs->heap[parent])){
+            break;
+        }
+        jobs->heap[i] = jobs->heap[parent];
+        i = parent;
+    }
+    jobs->heap[i] = task;
+}
+
+void ThreadPool_heap_sift_down(ThreadPool_job_queue_t *jobs, unsigned int i){
+    ThreadPool_job_t *task = jobs->heap[i];
+    while(1){
+        unsigned int child = 2 * i + 1;
+        if(child >= jobs->count){
+            break;
+        }
+        if(child + 1 < jobs->count && ThreadPool_job_before(jobs->heap[child + 1], jobs->heap[child])){
+            child++;
+        }
+        if(!ThreadPool_job_before(jobs->heap[child], task)){
+            break;
+        }
+        jobs->heap[i] = jobs->heap[child];
+        i = child;
+    }
+    jobs->heap[i] = task;
+}
+
+void ThreadPool_heap_reserve(ThreadPool_job_queue_t *jobs, unsigned int count){
+    if(count <= jobs->capacity){
+        return;
+    }
+    while(jobs->capacity < count){
+        jobs->capacity *= 2;
+    }
+    jobs->heap = (ThreadPool_job_t **)realloc(jobs->heap, sizeof(ThreadPool_job_t *) * jobs->capacity);
+}
+
+/**
+* Remove the shortest job from the heap. Caller must hold the pool lock
+* Parameters:
+*     jobs - Queue of the pool
+* Return:
+*     ThreadPool_job_t* - Shortest job, NULL if the heap is empty
+*/
+ThreadPool_job_t *ThreadPool_heap_pop(ThreadPool_job_queue_t *jobs){
+    if(jobs->count == 0){
+        return NULL;
+    }
+    ThreadPool_job_t *task = jobs->heap[0];
+    jobs->count--;
+    if(jobs->count > 0){
+        jobs->heap[0] = jobs->heap[jobs->count];
+        ThreadPool_heap_sift_down(jobs, 0);
+    }
+    return task;
+}
+
+/**
+* Add a job with an explicit cost estimate and kind to the ThreadPool's job queue
+* Parameters:
+*     tp      - Pointer to the ThreadPool object
+*     func    - Pointer to the function that will be called by the serving thread
+*     arg     - Arguments for that function
+*     jobSize - Cost estimate, SJF pools run smaller jobs first
+*     kind    - What the job is
+* Return:
+*     true  - On success
+*     false - Otherwise
+*/
+bool ThreadPool_add_task(ThreadPool_t *tp, thread_func_t func, void *arg, size_t jobSize, ThreadPool_job_kind_t kind){
+    ThreadPool_job_t *task = ThreadPool_new_job(func, arg, jobSize, kind);
+    if(tp->kind == THREADPOOL_WORK_STEALING){
+        ThreadPool_add_job_stealing(tp, task);
+        return true;
+    }
+    // sjf, O(log n) insert into the heap
+    ThreadPool_lock(&tp->lock);
+    ThreadPool_heap_reserve(&tp->jobs, tp->jobs.count + 1);
+    task->seq = tp->jobs.nextSeq++;
+    tp->jobs.heap[tp->jobs.count++] = task;
+    ThreadPool_heap_sift_up(&tp->jobs, tp->jobs.count - 1);
+
+    ThreadPool_latch_add(&tp->pending, 1);
+    if(DEBUG){printf("\nJob Pool Size ++ : %u", ThreadPool_latch_count(&tp->pending));
+        fflush(stdout);}
+    // Notify one worker thread
+    pthread_cond_signal(&tp->isWorkToDo);
+
+    pthread_mutex_unlock(&tp->lock);
+    return true;
+}
+
+/**
+* Add a job to the ThreadPool's job queue. The job has no cost estimate, so an
+* SJF pool runs it ahead of any sized job
 * Parameters:
 *     tp   - Pointer to the ThreadPool object
 *     func - Pointer to the function that will be called by the serving thread
@@ -112,51 +892,73 @@ void ThreadPool_destroy(ThreadPool_t *tp){
 *     false - Otherwise
 */
 bool ThreadPool_add_job(ThreadPool_t *tp, thread_func_t func, void *arg){
+    return ThreadPool_add_task(tp, func, arg, 0, JOB_GENERIC);
+}
 
-    struct stat fileInfo;
-    ThreadPool_job_t *task = (ThreadPool_job_t*)malloc(sizeof(ThreadPool_job_t));
-    task->next = NULL;
-    task->func = func;
-    char*str = (char*)arg;
-    if(stat(str, &fileInfo)==0) { // argument is a file name and thus mapper 
-        task->jobSize = fileInfo.st_size;
-        task->arg = str;
+/**
+* Add a batch of jobs running the same function to the ThreadPool's job queue.
+* Jobs are built outside the lock, then the whole batch is queued under a
+* single lock acquisition: pushed one by one when the batch is small, or
+* appended and re-heapified in O(n) when it is large
+* Parameters:
+*     tp    - Pointer to the ThreadPool object
+*     func  - Pointer to the function that will be called by the serving thread
+*     args  - Argument of each job
+*     sizes - Cost estimate of each job, NULL if the jobs are unsized
+*     count - Number of jobs
+*     kind  - What the jobs are
+* Return:
+*     true  - On success
+*     false - Otherwise
+*/
+bool ThreadPool_add_jobs(ThreadPool_t *tp, thread_func_t func, void **args, const size_t *sizes, unsigned int count, ThreadPool_job_kind_t kind){
+    if(count == 0){
+        return true;
     }
-    else{ // argument is not a valid file, type casting failed -> reducer function must be applied
-        ThreadArgs *threadArg= (ThreadArgs* )arg;
-        task->jobSize = threadArg->size;
-        task->arg = threadArg;
+    ThreadPool_job_t **tasks = (ThreadPool_job_t **)malloc(sizeof(ThreadPool_job_t *) * count);
+    for(unsigned int i = 0; i < count; i++){
+        tasks[i] = ThreadPool_new_job(func, args[i], (sizes != NULL) ? sizes[i] : 0, kind);
     }
-    // sjf
-    pthread_mutex_lock(&tp->lock);
-    if (tp->jobs.head == NULL) { // First job case
-        tp->jobs.head = task;
+    if(tp->kind == THREADPOOL_WORK_STEALING){
+        for(unsigned int i = 0; i < count; i++){
+            ThreadPool_add_job_stealing(tp, tasks[i]);
+        }
+        free(tasks);
+        return true;
     }
-    else { // Traverse the list
-        ThreadPool_job_t *previousTask = NULL;
-        ThreadPool_job_t *curentTask = tp->jobs.head;
 
-        while (curentTask != NULL && curentTask->jobSize <= task->jobSize) {
-            previousTask = curentTask;  // Store the previous task
-            curentTask = curentTask->next;  // Move to next task
+    ThreadPool_lock(&tp->lock);
+    ThreadPool_job_queue_t *jobs = &tp->jobs;
+    ThreadPool_heap_reserve(jobs, jobs->count + count);
+    unsigned int total = jobs->count + count;
+    unsigned int log = 0; // floor(log2(total))
+    while((total >> (log + 1)) != 0){
+        log++;
+    }
+    bool heapify = (unsigned long)count * log > 2UL * total; // Floyd's build heap beats count sift ups
+    for(unsigned int i = 0; i < count; i++){
+        tasks[i]->seq = jobs->nextSeq++;
+        jobs->heap[jobs->count++] = tasks[i];
+        if(!heapify){
+            ThreadPool_heap_sift_up(jobs, jobs->count - 1);
         }
-
-        // Inserting at the correct position
-        task->next = curentTask;
-        if (previousTask == NULL) {
-            tp->jobs.head = task;  // Insert at the head if previousTask is NULL
-        } else {
-            previousTask->next = task;  // Insert after previousTask
+    }
+    if(heapify){
+        for(unsigned int i = jobs->count / 2; i-- > 0;){
+            ThreadPool_heap_sift_down(jobs, i);
         }
     }
-
-    tp->jobs.size++;
-    if(DEBUG){printf("\nJob Pool Size ++ : %i", tp->jobs.size);
+    ThreadPool_latch_add(&tp->pending, count);
+    if(DEBUG){printf("\nJob Pool Size += %u : %u", count, ThreadPool_latch_count(&tp->pending));
         fflush(stdout);}
-    // Notify one worker thread
-    pthread_cond_signal(&tp->isWorkToDo);
-    
+    if(count == 1){
+        pthread_cond_signal(&tp->isWorkToDo);
+    }
+    else{
+        pthread_cond_broadcast(&tp->isWorkToDo);
+    }
     pthread_mutex_unlock(&tp->lock);
+    free(tasks);
     return true;
 }
 
@@ -168,25 +970,29 @@ bool ThreadPool_add_job(ThreadPool_t *tp, thread_func_t func, void *arg){
 *     ThreadPool_job_t* - Next job to run
 */
 ThreadPool_job_t *ThreadPool_get_job(ThreadPool_t *tp){
-    pthread_mutex_lock(&tp->lock);
+    ThreadPool_lock(&tp->lock);
     ThreadPool_job_t *task;
-    while (tp->jobs.head == NULL && !tp->shutdown) {
-        pthread_cond_signal(&tp->isIdle);
-        pthread_cond_wait(&tp->isWorkToDo, &tp->lock);  // Wait for a job
+    if (tp->jobs.count == 0 && !tp->shutdown) {
+        uint64_t start = ThreadPool_now();
+        while (tp->jobs.count == 0 && !tp->shutdown) {
+            pthread_cond_wait(&tp->isWorkToDo, &tp->lock);  // Wait for a job
+        }
+        if(currentWorker != NULL){
+            ThreadPool_metric_add(&currentWorker->metrics.idleNs, ThreadPool_now() - start);
+        }
     }
     // If the pool is shutting down, break out of the loop
     if (tp->shutdown) {
         pthread_mutex_unlock(&tp->lock);
         return NULL;
     }
-    task = tp->jobs.head;
+    task = ThreadPool_heap_pop(&tp->jobs);
     if( task ==NULL){
-        perror("Attempting to grab task when linked list is empty?");
+        perror("Attempting to grab task when the heap is empty?");
     }
-    tp->jobs.head = tp->jobs.head->next; // re-oder linked list 
     pthread_mutex_unlock(&tp->lock);
-    
-    return task; 
+
+    return task;
 
 }
 
@@ -194,47 +1000,143 @@ ThreadPool_job_t *ThreadPool_get_job(ThreadPool_t *tp){
 * Start routine of each thread in the ThreadPool Object
 * In a loop, check the job queue, get a job (if any) and run it
 * Parameters:
-*     tp - Pointer to the ThreadPool object containing this thread
+*     worker - Worker owning this thread
 */
-void *Thread_run(ThreadPool_t *tp){
+void *Thread_run(ThreadPool_worker_t *worker){
+    ThreadPool_t *tp = worker->pool;
+    currentWorker = worker;
+    ThreadPool_pin(worker);
     while(1){
         ThreadPool_job_t *task = ThreadPool_get_job(tp); // waits internally 
         if(task ==NULL){
             break;
         }
-        
-        task->func(task->arg);
-
-        pthread_mutex_lock(&tp->lock);
-        tp->jobs.size --;
         if(DEBUG){
-            printf("\nJob Pool Size -- : %i", tp->jobs.size);
+            printf("\nJob Pool Size : %u", ThreadPool_latch_count(&tp->pending));
             fflush(stdout);
             printf("\n\tJob Size: %zu", task->jobSize);
             fflush(stdout);
             printf("\n\tThread ID: %lu", (unsigned long)pthread_self());
             fflush(stdout);
             }
-        free(task);
-        pthread_mutex_unlock(&tp->lock);
+        ThreadPool_run_job(worker, task);
     }
+    currentWorker = NULL;
     return NULL;
 }
 /**
-* Ensure that all threads are idle and the job queue is empty before returning
+* Ensure that all threads are idle and the job queue is empty before returning.
+* Sleeps on the pool's pending latch, which the last running job opens
 * Parameters:
 *     tp - Pointer to the ThreadPool object that will be destroyed
 */
 void ThreadPool_check(ThreadPool_t *tp){
-    pthread_mutex_lock(&tp->lock);
-    
+    ThreadPool_latch_wait(&tp->pending);
+}
 
-    while (tp->jobs.size>0 || tp->jobs.head != NULL){
-        // pthread_cond_signal(&tp->isWorkToDo);
-        pthread_cond_wait(&tp->isIdle, &tp->lock);
+/**
+* Turn span recording on or off. Metrics are always counted
+* Parameters:
+*     tp      - Pointer to the ThreadPool object
+*     enabled - Record a span for every job run from now on
+*/
+void ThreadPool_set_tracing(ThreadPool_t *tp, bool enabled){
+    __atomic_store_n(&tp->tracing, enabled, __ATOMIC_RELAXED);
+}
+
+/**
+* Copy every worker's counters. Safe while jobs run; each counter is then
+* a recent value rather than a consistent snapshot
+* Parameters:
+*     tp      - Pointer to the ThreadPool object
+*     metrics - Array of num_workers entries to fill in
+*/
+void ThreadPool_get_metrics(ThreadPool_t *tp, ThreadPool_metrics_t *metrics){
+    for(int i = 0; i < tp->num_workers; i++){
+        ThreadPool_metrics_t *source = &tp->workers[i].metrics;
+        metrics[i].jobs = __atomic_load_n(&source->jobs, __ATOMIC_RELAXED);
+        metrics[i].busyNs = __atomic_load_n(&source->busyNs, __ATOMIC_RELAXED);
+        metrics[i].idleNs = __atomic_load_n(&source->idleNs, __ATOMIC_RELAXED);
+        metrics[i].lockWaitNs = __atomic_load_n(&source->lockWaitNs, __ATOMIC_RELAXED);
+        metrics[i].steals = __atomic_load_n(&source->steals, __ATOMIC_RELAXED);
     }
-    pthread_mutex_unlock(&tp->lock);
-    return; 
+}
+
+/**
+* Print every worker's counters, one line per worker
+* Parameters:
+*     stream - Where to print
+*     tp     - Pointer to the ThreadPool object
+*/
+void ThreadPool_print_metrics(FILE *stream, ThreadPool_t *tp){
+    ThreadPool_metrics_t *metrics = (ThreadPool_metrics_t *)malloc(sizeof(ThreadPool_metrics_t) * tp->num_workers);
+    ThreadPool_get_metrics(tp, metrics);
+    fprintf(stream, "worker %5s %5s %10s %12s %12s %12s %10s\n", "cpu", "node", "jobs", "busy ms", "idle ms", "lock ms", "steals");
+    for(int i = 0; i < tp->num_workers; i++){
+        fprintf(stream, "%6d %5d %5d %10llu %12.3f %12.3f %12.3f %10llu\n", i, tp->workers[i].cpu, tp->workers[i].node,
+                (unsigned long long)metrics[i].jobs, metrics[i].busyNs / 1e6, metrics[i].idleNs / 1e6,
+                metrics[i].lockWaitNs / 1e6, (unsigned long long)metrics[i].steals);
+    }
+    free(metrics);
+}
+
+const char *ThreadPool_job_kind_name(ThreadPool_job_kind_t kind){
+    switch(kind){
+        case JOB_MAP: return "map";
+        case JOB_REDUCE: return "reduce";
+        default: return "job";
+    }
+}
+
+/**
+* Write the recorded spans as a Chrome trace (chrome://tracing, Perfetto):
+* one complete event per job on its worker's track, followed by a "workers"
+* array with each worker's counters. Call once the pool is idle, e.g. after
+* ThreadPool_check, as workers append spans without a lock
+* Parameters:
+*     tp   - Pointer to the ThreadPool object
+*     path - File to write
+* Return:
+*     true  - On success
+*     false - Otherwise
+*/
+bool ThreadPool_write_trace(ThreadPool_t *tp, const char *path){
+    FILE *stream = fopen(path, "w");
+    if(stream == NULL){
+        perror(path);
+        return false;
+    }
+    int pid = (int)getpid();
+    fprintf(stream, "{\"traceEvents\":[");
+    const char *separator = "\n";
+    for(int i = 0; i < tp->num_workers; i++){
+        ThreadPool_worker_t *worker = &tp->workers[i];
+        fprintf(stream, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}", separator, pid, i, i);
+        separator = ",\n";
+        for(size_t j = 0; j < worker->spanCount; j++){
+            ThreadPool_span_t *span = &worker->spans[j];
+            fprintf(stream, ",\n{\"name\":\"%s\",\"cat\":\"job\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"size\":%zu}}",
+                    ThreadPool_job_kind_name(span->kind), pid, i, span->start / 1e3, span->duration / 1e3, span->jobSize);
+        }
+    }
+    fprintf(stream, "\n],\n\"workers\":[");
+    ThreadPool_metrics_t *metrics = (ThreadPool_metrics_t *)malloc(sizeof(ThreadPool_metrics_t) * tp->num_workers);
+    ThreadPool_get_metrics(tp, metrics);
+    for(int i = 0; i < tp->num_workers; i++){
+        fprintf(stream, "%s\n{\"worker\":%d,\"cpu\":%d,\"node\":%d,\"jobs\":%llu,\"busy_ns\":%llu,\"idle_ns\":%llu,\"lock_wait_ns\":%llu,\"steals\":%llu}",
+                (i > 0) ? "," : "", i, tp->workers[i].cpu, tp->workers[i].node, (unsigned long long)metrics[i].jobs, (unsigned long long)metrics[i].busyNs,
+                (unsigned long long)metrics[i].idleNs, (unsigned long long)metrics[i].lockWaitNs, (unsigned long long)metrics[i].steals);
+    }
+    free(metrics);
+    fprintf(stream, "\n]}\n");
+    bool ok = !ferror(stream);
+    if(fclose(stream) != 0){
+        ok = false;
+    }
+    if(!ok){
+        perror(path);
+    }
+    return ok;
 }
 
 #endif
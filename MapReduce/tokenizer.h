@@ -0,0 +1,195 @@
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TOKENIZER_X86 1
+#else
+#define TOKENIZER_X86 0
+#endif
+
+#define TOKENIZER_MAX_SIMD_DELIMITERS 8 // Larger delimiter sets always use the scalar scanner
+
+typedef struct MR_Token {
+    const char *data;                   // First byte of the token, not NUL terminated
+    size_t length;                      // Bytes in the token, never 0
+} MR_Token;
+
+typedef enum {TOKENIZER_SCALAR, TOKENIZER_SSE2, TOKENIZER_AVX2} MR_TokenizerLevel;
+
+typedef struct MR_Tokenizer {
+    bool isDelimiter[256];              // Bytes that separate tokens
+    unsigned char delimiters[TOKENIZER_MAX_SIMD_DELIMITERS];
+    unsigned int delimiterCount;
+    MR_TokenizerLevel level;            // Scanner picked for this CPU and delimiter set
+} MR_Tokenizer;
+
+typedef struct MR_ScanBlock {
+    const char *start;                  // First of the 64 bytes described by delimiters, NULL when nothing is cached
+    uint64_t delimiters;                // Bit i set when start[i] is a delimiter
+} MR_ScanBlock;
+
+/**
+* Scalar scanner, also used for the tail of the input shorter than a block
+* Parameters:
+*     tokenizer     - Initialised tokenizer
+*     p             - First byte to look at
+*     end           - End of the input
+*     skip          - Find the first byte that is not a delimiter when true, the first delimiter when false
+* Return:
+*     const char*   - Matching byte, end if there is none
+*/
+const char *MR_ScanScalar(const MR_Tokenizer *tokenizer, const char *p, const char *end, bool skip){
+    const bool *isDelimiter = tokenizer->isDelimiter;
+    while(p < end && isDelimiter[(unsigned char)*p] == skip){
+        p++;
+    }
+    return p;
+}
+
+#if TOKENIZER_X86
+__attribute__((target("sse2")))
+uint64_t MR_DelimiterMaskSSE2(const MR_Tokenizer *tokenizer, const char *p){
+    uint64_t mask = 0;
+    for(int part = 0; part < 4; part++){
+        __m128i block = _mm_loadu_si128((const __m128i *)(p + 16 * part));
+        __m128i match = _mm_cmpeq_epi8(block, _mm_set1_epi8((char)tokenizer->delimiters[0]));
+        for(unsigned int i = 1; i < tokenizer->delimiterCount; i++){
+            match = _mm_or_si128(match, _mm_cmpeq_epi8(block, _mm_set1_epi8((char)tokenizer->delimiters[i])));
+        }
+        mask |= (uint64_t)(unsigned int)_mm_movemask_epi8(match) << (16 * part);
+    }
+    return mask;
+}
+
+__attribute__((target("avx2")))
+uint64_t MR_DelimiterMaskAVX2(const MR_Tokenizer *tokenizer, const char *p){
+    __m256i low = _mm256_loadu_si256((const __m256i *)p);
+    __m256i high = _mm256_loadu_si256((const __m256i *)(p + 32));
+    __m256i needle = _mm256_set1_epi8((char)tokenizer->delimiters[0]);
+    __m256i matchLow = _mm256_cmpeq_epi8(low, needle);
+    __m256i matchHigh = _mm256_cmpeq_epi8(high, needle);
+    for(unsigned int i = 1; i < tokenizer->delimiterCount; i++){
+        needle = _mm256_set1_epi8((char)tokenizer->delimiters[i]);
+        matchLow = _mm256_or_si256(matchLow, _mm256_cmpeq_epi8(low, needle));
+        matchHigh = _mm256_or_si256(matchHigh, _mm256_cmpeq_epi8(high, needle));
+    }
+    return (uint64_t)(unsigned int)_mm256_movemask_epi8(matchLow) |
+           (uint64_t)(unsigned int)_mm256_movemask_epi8(matchHigh) << 32;
+}
+#endif
+
+/**
+* Best scanner this CPU supports, checked once per process
+* Return:
+*     MR_TokenizerLevel - TOKENIZER_AVX2, TOKENIZER_SSE2 or TOKENIZER_SCALAR
+*/
+MR_TokenizerLevel MR_TokenizerCpuLevel(){
+#if TOKENIZER_X86
+    static int level = -1;
+    int cached = __atomic_load_n(&level, __ATOMIC_RELAXED);
+    if(cached < 0){
+        __builtin_cpu_init();
+        cached = __builtin_cpu_supports("avx2") ? TOKENIZER_AVX2 :
+                 __builtin_cpu_supports("sse2") ? TOKENIZER_SSE2 : TOKENIZER_SCALAR;
+        __atomic_store_n(&level, cached, __ATOMIC_RELAXED);
+    }
+    return (MR_TokenizerLevel)cached;
+#else
+    return TOKENIZER_SCALAR;
+#endif
+}
+
+/**
+* Set up a tokenizer for a delimiter set, picking the widest scanner the CPU
+* supports. Sets of more than TOKENIZER_MAX_SIMD_DELIMITERS bytes use the
+* scalar scanner
+* Parameters:
+*     tokenizer     - Tokenizer to initialise
+*     delimiters    - NUL terminated set of bytes separating tokens, e.g. " \t\n\r"
+*/
+void MR_TokenizerInit(MR_Tokenizer *tokenizer, const char *delimiters){
+    memset(tokenizer->isDelimiter, 0, sizeof(tokenizer->isDelimiter));
+    tokenizer->delimiterCount = 0;
+    bool fits = true;
+    for(const unsigned char *d = (const unsigned char *)delimiters; *d != '\0'; d++){
+        if(tokenizer->isDelimiter[*d]){
+            continue;
+        }
+        tokenizer->isDelimiter[*d] = true;
+        if(tokenizer->delimiterCount == TOKENIZER_MAX_SIMD_DELIMITERS){
+            fits = false;
+            continue;
+        }
+        tokenizer->delimiters[tokenizer->delimiterCount++] = *d;
+    }
+    tokenizer->level = fits && tokenizer->delimiterCount > 0 ? MR_TokenizerCpuLevel() : TOKENIZER_SCALAR;
+}
+
+/**
+* Scan forward from p for the first delimiter (skip false) or the first byte
+* that is not a delimiter (skip true). The vector scanners classify 64 bytes
+* at a time and keep the mask in block, so consecutive scans over the same
+* bytes, e.g. the start and end of a short token, load them only once
+* Parameters:
+*     tokenizer     - Initialised tokenizer
+*     block         - Cached mask, start set to NULL whenever the bytes under it change
+*     p             - First byte to look at
+*     end           - End of the input
+*     skip          - What to search for
+* Return:
+*     const char*   - Matching byte, end if there is none
+*/
+const char *MR_TokenizerScan(const MR_Tokenizer *tokenizer, MR_ScanBlock *block, const char *p, const char *end, bool skip){
+    if(tokenizer->level == TOKENIZER_SCALAR){
+        return MR_ScanScalar(tokenizer, p, end, skip);
+    }
+    while(p < end){
+        if(block->start == NULL || p < block->start || p >= block->start + 64){
+            if(end - p < 64){
+                block->start = NULL;
+                return MR_ScanScalar(tokenizer, p, end, skip);
+            }
+            block->start = p;
+#if TOKENIZER_X86
+            block->delimiters = tokenizer->level == TOKENIZER_AVX2 ? MR_DelimiterMaskAVX2(tokenizer, p) : MR_DelimiterMaskSSE2(tokenizer, p);
+#endif
+        }
+        unsigned int offset = p - block->start;
+        uint64_t bits = (skip ? ~block->delimiters : block->delimiters) >> offset;
+        if(bits != 0){
+            return p + __builtin_ctzll(bits);
+        }
+        p = block->start + 64;
+    }
+    return end;
+}
+
+/**
+* Get the next non-empty token between *cursor and end
+* Parameters:
+*     tokenizer     - Initialised tokenizer
+*     block         - Scan cache of the input, start NULL before the first call
+*     cursor        - Scan position, moved past the token
+*     end           - End of the input
+*     token         - Set to the token
+* Return:
+*     true          - If a token was found
+*     false         - If only delimiters were left
+*/
+bool MR_NextToken(const MR_Tokenizer *tokenizer, MR_ScanBlock *block, const char **cursor, const char *end, MR_Token *token){
+    const char *start = MR_TokenizerScan(tokenizer, block, *cursor, end, true);
+    if(start == end){
+        *cursor = end;
+        return false;
+    }
+    *cursor = MR_TokenizerScan(tokenizer, block, start, end, false);
+    token->data = start;
+    token->length = *cursor - start;
+    return true;
+}
+
+#endif